@@ -0,0 +1,34 @@
+#!/bin/bash
+#
+# Reports the packets per second, trace bytes per second and peak RSS of each proj4
+# analysis mode over one trace, best of several runs, with output discarded.
+# If BENCH_CSV is set, also appends one row per mode to that file for regression tracking:
+#   date,commit,trace,packets,trace_bytes,mode,seconds,pkts_per_sec,bytes_per_sec,peak_rss_kb
+#
+# usage: ./bench_modes.sh trace_file [proj4_binary] [runs]
+
+TRACE=${1:?usage: $0 trace_file [proj4_binary] [runs]}
+PROJ4=${2:-./proj4}
+RUNS=${3:-3}
+BENCH_RUN=${BENCH_RUN:-$(dirname "$0")/bench_run}
+
+PKTS=$("$PROJ4" -s -t "$TRACE" | awk '/TOTAL PACKETS/ { print $3 }')
+BYTES=$(stat -c %s "$TRACE")
+COMMIT=$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null || echo unknown)
+echo "$TRACE: $PKTS packets, $BYTES bytes"
+printf "%-10s %10s %14s %10s %10s\n" mode seconds pkts/s MB/s "peak RSS"
+
+for args in "-s" "-l" "-p" "-m" "-m -k 100" "-b 1"
+do
+    read ns kb < <("$BENCH_RUN" "$RUNS" "$PROJ4" $args -t "$TRACE") || exit 1
+    [ -n "$ns" ] || exit 1
+    awk -v args="$args" -v ns=$ns -v kb=$kb -v pkts=$PKTS -v bytes=$BYTES \
+        'BEGIN { printf "%-10s %10.3f %14.0f %10.1f %7.1f MB\n", args, ns / 1e9, pkts / (ns / 1e9),
+                 bytes / (ns / 1e9) / 1e6, kb / 1024 }'
+    if [ -n "$BENCH_CSV" ]; then
+        awk -v date="$(date -u +%Y-%m-%dT%H:%M:%SZ)" -v commit="$COMMIT" -v trace="$TRACE" \
+            -v args="$args" -v ns=$ns -v kb=$kb -v pkts=$PKTS -v bytes=$BYTES \
+            'BEGIN { printf "%s,%s,%s,%d,%d,%s,%.6f,%.0f,%.0f,%d\n", date, commit, trace, pkts, bytes,
+                     args, ns / 1e9, pkts / (ns / 1e9), bytes / (ns / 1e9), kb }' >> "$BENCH_CSV"
+    fi
+done
@@ -0,0 +1,84 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: bench_run.cpp
+ *
+ * Runs a command several times with its output discarded and prints the best wall clock
+ * time in nanoseconds and the largest peak resident set size in kilobytes, for the
+ * benchmark scripts. Exits with an error as soon as one run fails.
+ * */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define ERROR_PREFIX "ERROR: "
+
+
+int errexit(const char *msg_format, const char *arg)
+{
+    fprintf(stderr, ERROR_PREFIX);
+    fprintf(stderr, msg_format, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+int main(int argc, char *argv[])
+{
+    long long best_ns = -1;
+    long peak_kb = 0;
+    int runs;
+
+    if (argc < 3 || (runs = atoi(argv[1])) < 1)
+    {
+        fprintf(stderr, "%s runs command [args...]\n", argv[0]);
+        exit(1);
+    }
+
+    for (int i = 0; i < runs; i++)
+    {
+        long long start = now_ns();
+        pid_t pid = fork();
+        if (pid < 0)
+            errexit("cannot fork to run %s", argv[2]);
+        if (pid == 0)
+        {
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0)
+                dup2(null_fd, STDOUT_FILENO);
+            execvp(argv[2], argv + 2);
+            errexit("cannot run %s", argv[2]);
+        }
+
+        int status;
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) != pid)
+            errexit("cannot wait for %s", argv[2]);
+        long long ns = now_ns() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            errexit("%s failed", argv[2]);
+
+        if (best_ns < 0 || ns < best_ns)
+            best_ns = ns;
+        if (usage.ru_maxrss > peak_kb)
+            peak_kb = usage.ru_maxrss;      // kilobytes on Linux
+    }
+    printf("%lld %ld\n", best_ns, peak_kb);
+    return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: checkpoint.cpp
+ *
+ * Snapshot files of the aggregate state, so that a capture rotated into segments can be
+ * reported on cumulatively by resuming from the snapshot of the segments before and only
+ * scanning the new one. The modes serialize their own state; this file only frames it.
+ * */
+
+
+#include <stdio.h>
+#include <string>
+#include "checkpoint.h"
+#include "next.h"
+
+
+/**
+ * Writes every section of a snapshot to filename. The file is written next to it and
+ * renamed into place, so a snapshot being resumed from is never left half written.
+*/
+void save_checkpoint(const char *filename, const struct checkpoint *ck)
+{
+    std::string tmp = std::string(filename) + CKPT_TMP_SUFFIX;
+    struct ckpt_file_header hdr;
+    FILE *out = fopen(tmp.c_str(), "wb");
+
+    if (out == NULL)
+        errexit("cannot create snapshot file %s", tmp.c_str());
+
+    memset(&hdr, 0x0, sizeof(hdr));
+    memcpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+    hdr.num_sections = ck->sections.size();
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    for (const auto &section: ck->sections)
+    {
+        struct ckpt_section_header sec = { section.first, 0, section.second.size() };
+        fwrite(&sec, sizeof(sec), 1, out);
+        fwrite(section.second.data(), 1, section.second.size(), out);
+    }
+
+    if (ferror(out) || fclose(out) != 0 || rename(tmp.c_str(), filename) != 0)
+        errexit("cannot write snapshot file %s", filename);
+}
+
+
+/**
+ * Reads every section of the snapshot in filename.
+*/
+void load_checkpoint(const char *filename, struct checkpoint *ck)
+{
+    struct ckpt_file_header hdr;
+    FILE *in = fopen(filename, "rb");
+
+    if (in == NULL)
+        errexit("cannot open snapshot file %s", filename);
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic)) != 0)
+        errexit("%s is not a snapshot file", filename);
+
+    ck->sections.clear();
+    for (uint32_t i = 0; i < hdr.num_sections; i++)
+    {
+        struct ckpt_section_header sec;
+        if (fread(&sec, sizeof(sec), 1, in) != 1)
+            errexit("truncated snapshot file %s", filename);
+
+        std::vector<unsigned char> &data = ck->sections[sec.tag];
+        data.resize(sec.size);
+        if (sec.size > 0 && fread(data.data(), 1, sec.size, in) != sec.size)
+            errexit("truncated snapshot file %s", filename);
+    }
+    fclose(in);
+}
@@ -0,0 +1,73 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+#define CKPT_MAGIC "P4CKPT01"
+#define CKPT_TMP_SUFFIX ".tmp"
+
+/* tags of the sections of a snapshot, one per mode whose state it holds */
+enum ckpt_tag { CKPT_SUMMARY = 1, CKPT_MATRIX = 2 };
+
+/*
+ * Layout of a snapshot file, all in host byte order: a ckpt_file_header, then num_sections
+ * times a ckpt_section_header followed by size bytes of serialized state.
+ */
+struct ckpt_file_header
+{
+    char magic[8];
+    uint32_t num_sections;
+    uint32_t reserved;
+};
+
+struct ckpt_section_header
+{
+    uint32_t tag;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+/* aggregate state saved by -C and resumed by -R: the serialized state of each section */
+struct checkpoint
+{
+    std::map<uint32_t, std::vector<unsigned char> > sections;
+};
+
+/* read position in the serialized state of one section */
+struct ckpt_reader
+{
+    const unsigned char *p;
+    const unsigned char *end;
+};
+
+
+/**
+ * Appends len bytes of state to a section.
+*/
+static inline void ckpt_put(std::vector<unsigned char> &out, const void *data, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    out.insert(out.end(), bytes, bytes + len);
+}
+
+
+/**
+ * Reads the next len bytes of a section. Returns false if the section is too short.
+*/
+static inline bool ckpt_get(struct ckpt_reader *in, void *data, size_t len)
+{
+    if ((size_t) (in->end - in->p) < len)
+        return false;
+    memcpy(data, in->p, len);
+    in->p += len;
+    return true;
+}
+
+void save_checkpoint(const char *filename, const struct checkpoint *ck);
+void load_checkpoint(const char *filename, struct checkpoint *ck);
+
+#endif
@@ -0,0 +1,221 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: column_export.cpp
+ *
+ * Column oriented binary export of decoded header fields (-x). Analysis tools can mmap
+ * the file and view each column as a typed array, e.g. with numpy.memmap.
+ * */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+#include <algorithm>
+#include "next.h"
+#include "column_export.h"
+#include "stats.h"
+
+/* name, type and width of each column, in col_row order */
+static const struct
+{
+    const char *name;
+    uint32_t type;
+    uint32_t width;
+} COLUMNS[COL_NUM_COLUMNS] = {
+    { "ts", COL_FLOAT, 8 },
+    { "caplen", COL_UINT, 4 },
+    { "ip_len", COL_UINT, 4 },
+    { "iphl", COL_UINT, 1 },
+    { "protocol", COL_UINT, 1 },
+    { "sport", COL_UINT, 2 },
+    { "dport", COL_UINT, 2 },
+    { "seq", COL_UINT, 4 },
+    { "ack", COL_UINT, 4 },
+    { "window", COL_UINT, 2 },
+    { "payload_len", COL_INT, 4 },
+};
+
+
+/**
+ * Opens an export file, or an in-memory writer if filename is NULL.
+*/
+void col_open(struct col_writer *w, const char *filename)
+{
+    w->fd = -1;
+    w->num_rows = 0;
+    if (filename != NULL && (w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        errexit("cannot open export file %s", filename);
+    STATS_SYSCALL(SYSCALL_OTHER);
+
+    // The first column starts right after the header and descriptors
+    if (filename != NULL && lseek(w->fd, COL_ALIGN, SEEK_SET) != COL_ALIGN)
+        errexit("cannot write export file %s", filename);
+    out_open(&w->columns[0], w->fd);
+
+    for (int i = 1; i < COL_NUM_COLUMNS; i++)
+    {
+        int spill_fd = -1;
+        if (filename != NULL)
+        {
+            std::string path = std::string(filename) + ".XXXXXX";
+            if ((spill_fd = mkstemp(&path[0])) < 0)
+                errexit("cannot create temporary file next to %s", filename);
+            unlink(path.c_str());
+            STATS_SYSCALL(SYSCALL_OTHER);
+            STATS_SYSCALL(SYSCALL_OTHER);
+        }
+        out_open(&w->columns[i], spill_fd);
+    }
+}
+
+
+/**
+ * Appends n bytes of one value to a column.
+*/
+static inline void put(struct out_buf *column, const void *value, size_t n)
+{
+    char *p = out_reserve(column, n);
+    memcpy(p, value, n);
+    out_commit(column, p + n);
+}
+
+
+/**
+ * Appends one packet to every column.
+*/
+void col_append(struct col_writer *w, const struct col_row &row)
+{
+    struct out_buf *c = w->columns;
+
+    put(c++, &row.ts, sizeof(row.ts));
+    put(c++, &row.caplen, sizeof(row.caplen));
+    put(c++, &row.ip_len, sizeof(row.ip_len));
+    put(c++, &row.iphl, sizeof(row.iphl));
+    put(c++, &row.protocol, sizeof(row.protocol));
+    put(c++, &row.sport, sizeof(row.sport));
+    put(c++, &row.dport, sizeof(row.dport));
+    put(c++, &row.seq, sizeof(row.seq));
+    put(c++, &row.ack, sizeof(row.ack));
+    put(c++, &row.window, sizeof(row.window));
+    put(c++, &row.payload_len, sizeof(row.payload_len));
+    w->num_rows++;
+}
+
+
+/**
+ * Appends the rows of an in-memory writer for a later part of the trace, and frees it.
+*/
+void col_append_writer(struct col_writer *w, struct col_writer *later)
+{
+    for (int i = 0; i < COL_NUM_COLUMNS; i++)
+    {
+        out_write(&w->columns[i], later->columns[i].data, later->columns[i].len);
+        out_close(&later->columns[i]);
+    }
+    w->num_rows += later->num_rows;
+}
+
+
+/**
+ * Writes len bytes to fd at off, or exits.
+*/
+static void write_at(int fd, const void *data, size_t len, off_t off)
+{
+    size_t written = 0;
+
+    while (written < len)
+    {
+        ssize_t n = pwrite(fd, (const char *) data + written, len - written, off + written);
+        STATS_SYSCALL(SYSCALL_WRITE);
+        if (n <= 0)
+            errexit("cannot write export file", NULL);
+        written += n;
+    }
+}
+
+
+/**
+ * Copies the len bytes of a spilled column to off in the export file. copy_file_range()
+ * keeps the copy in the kernel (or shares the blocks, on filesystems that can); where it
+ * is not supported, the column is read back and written in blocks.
+*/
+static void copy_column(int out_fd, int spill_fd, size_t len, off_t off)
+{
+    loff_t in_off = 0;
+    loff_t out_off = off;
+
+    while ((size_t) in_off < len)
+    {
+        ssize_t n = copy_file_range(spill_fd, &in_off, out_fd, &out_off, len - in_off, 0);
+        STATS_SYSCALL(SYSCALL_WRITE);
+        if (n > 0)
+            continue;
+        if (n == 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP))
+            errexit("cannot copy export column", NULL);
+        break;
+    }
+
+    char *block = NULL;
+    while ((size_t) in_off < len)
+    {
+        if (block == NULL && (block = (char *) malloc(OUT_BUF_SIZE)) == NULL)
+            errexit("Out of memory", NULL);
+        ssize_t n = pread(spill_fd, block, std::min((size_t) OUT_BUF_SIZE, len - in_off), in_off);
+        STATS_SYSCALL(SYSCALL_READ);
+        if (n <= 0)
+            errexit("cannot read back export column", NULL);
+        write_at(out_fd, block, n, out_off);
+        in_off += n;
+        out_off += n;
+    }
+    free(block);
+}
+
+
+/**
+ * Lays out the header and every column in the export file and closes it.
+*/
+void col_close(struct col_writer *w)
+{
+    struct col_file_header hdr;
+    struct col_descriptor desc[COL_NUM_COLUMNS];
+    off_t off = COL_ALIGN;
+
+    memset(&hdr, 0x0, sizeof(hdr));
+    memcpy(hdr.magic, COL_MAGIC, sizeof(hdr.magic));
+    hdr.num_rows = w->num_rows;
+    hdr.num_columns = COL_NUM_COLUMNS;
+    memset(desc, 0x0, sizeof(desc));
+
+    for (int i = 0; i < COL_NUM_COLUMNS; i++)
+    {
+        struct out_buf *column = &w->columns[i];
+        size_t len = w->num_rows * COLUMNS[i].width;
+
+        off = (off + COL_ALIGN - 1) / COL_ALIGN * COL_ALIGN;
+        strncpy(desc[i].name, COLUMNS[i].name, COL_NAME_SIZE);
+        desc[i].type = COLUMNS[i].type;
+        desc[i].width = COLUMNS[i].width;
+        desc[i].offset = off;
+
+        // The first column is already in place, the others are copied in from their spill files
+        out_flush(column);
+        if (i > 0)
+        {
+            copy_column(w->fd, column->fd, len, off);
+            close(column->fd);
+        }
+        off += len;
+        column->fd = -1;
+        out_close(column);
+    }
+
+    write_at(w->fd, &hdr, sizeof(hdr), 0);
+    write_at(w->fd, desc, sizeof(desc), sizeof(hdr));
+    if (close(w->fd) != 0)
+        errexit("cannot write export file", NULL);
+}
@@ -0,0 +1,72 @@
+#ifndef COLUMN_EXPORT_H
+#define COLUMN_EXPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "out_buf.h"
+
+#define COL_MAGIC "P4COLS01"
+#define COL_ALIGN 4096              /* columns start page aligned so each can be mmapped */
+#define COL_NUM_COLUMNS 11
+#define COL_NAME_SIZE 16
+
+/* element types of the columns, in the type field of their descriptors */
+enum col_type { COL_UINT = 0, COL_INT = 1, COL_FLOAT = 2 };
+
+/*
+ * Layout of an export file, all in host byte order: a col_file_header, num_columns
+ * col_descriptors, then each column as a packed array of num_rows elements at its offset.
+ */
+struct col_file_header
+{
+    char magic[8];
+    uint64_t num_rows;
+    uint32_t num_columns;
+    uint32_t reserved;
+};
+
+struct col_descriptor
+{
+    char name[COL_NAME_SIZE];       /* NUL padded */
+    uint32_t type;
+    uint32_t width;                 /* bytes per element */
+    uint64_t offset;
+};
+
+/* decoded fields of one packet, one per column; 0 where the header is missing */
+struct col_row
+{
+    double ts;
+    uint32_t caplen;
+    uint32_t ip_len;                /* IPv6: 40 + payload length, which can pass 65535 */
+    uint8_t iphl;
+    uint8_t protocol;               /* IP protocol number */
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t seq;
+    uint32_t ack;                   /* 0 unless the ACK flag is set, as -p prints it */
+    uint16_t window;
+    int32_t payload_len;            /* -1 if it cannot be computed */
+};
+
+/**
+ * Writer of an export file. Every column is buffered separately and written out in large
+ * blocks: the first one straight to its place in the export file, the others each to an
+ * unlinked temporary file next to it, as their offsets are only known once the number of
+ * rows is. Closing the writer copies them in after the first with copy_file_range(), so
+ * that each column is one contiguous array. With fd < 0 the columns just grow in memory
+ * (used for per-chunk output).
+*/
+struct col_writer
+{
+    int fd;
+    uint64_t num_rows;
+    struct out_buf columns[COL_NUM_COLUMNS];
+};
+
+void col_open(struct col_writer *w, const char *filename);
+void col_append(struct col_writer *w, const struct col_row &row);
+void col_append_writer(struct col_writer *w, struct col_writer *later);
+void col_close(struct col_writer *w);
+
+#endif
@@ -0,0 +1,481 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: decompress.cpp
+ *
+ * Byte source behind the reader's stream buffers: the trace as it is (pipes and stdin),
+ * or gzip / zstd compressed traces decompressed on the fly, told apart by their magic
+ * number. It runs on the reader's producer thread, so decompression overlaps parsing.
+ * A memory-mapped zstd trace made of several frames (pzstd, or concatenated .zst files)
+ * is further split at frame boundaries and its frames are decompressed on worker
+ * threads, a bounded window of frames ahead of the one being read.
+ * zstd support needs libzstd (make ZSTD=1).
+ * */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "next.h"
+#include "decompress.h"
+#include "stats.h"
+
+#define IN_BUF_SIZE (1 << 20)       /* compressed bytes read from a pipe at a time */
+#define FRAMES_PER_THREAD 2         /* zstd frames decompressed ahead, per worker */
+#define MAX_PARALLEL_FRAME (256 << 20)  /* larger zstd frames are streamed instead */
+
+static const unsigned char GZIP_MAGIC[] = { 0x1f, 0x8b };
+static const unsigned char ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+#ifdef HAVE_ZSTD
+/* one zstd frame of a mapped trace and, once a worker is done with it, its contents */
+struct zstd_job
+{
+    const unsigned char *in;
+    size_t in_len;
+    std::vector<unsigned char> out;
+    size_t out_pos;             /* bytes of out already handed to the reader */
+    bool claimed;               /* a worker has taken it */
+    bool done;
+};
+#endif
+
+struct trace_source
+{
+    enum trace_compression compression;
+    int fd;
+    const unsigned char *map;   /* whole compressed file, NULL when reading fd */
+    size_t map_len;
+    bool map_taken;             /* the mapping has been handed out as input */
+    unsigned char head[COMPRESS_MAGIC_SIZE];    /* bytes read from fd to sniff the format */
+    size_t head_len;
+    bool head_taken;
+    unsigned char *in_buf;
+    const unsigned char *in;    /* compressed input not consumed yet */
+    size_t in_len;
+    bool between_members;       /* at the end of a gzip member or zstd frame */
+
+    z_stream gz;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zds;
+
+    // Frame-parallel decompression of a mapped trace
+    bool parallel;
+    std::vector<struct zstd_job> frames;
+    size_t next_frame;          /* first frame not yet in the window */
+    std::deque<struct zstd_job *> window;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable changed;
+    bool stop;
+#endif
+};
+
+
+/**
+ * Returns the compression of a trace from its first bytes.
+*/
+enum trace_compression detect_compression(const unsigned char *head, size_t len)
+{
+    if (len >= sizeof(GZIP_MAGIC) && memcmp(head, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0)
+        return COMPRESS_GZIP;
+    if (len >= sizeof(ZSTD_MAGIC) && memcmp(head, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0)
+        return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+
+/**
+ * Makes sure there is unconsumed input: the mapping, then the sniffed head bytes, then
+ * whatever the next read() returns. Returns false at end of input.
+*/
+static bool refill(struct trace_source *src)
+{
+    if (src->in_len > 0)
+        return true;
+
+    if (src->map != NULL)
+    {
+        if (src->map_taken)
+            return false;
+        src->map_taken = true;
+        src->in = src->map;
+        src->in_len = src->map_len;
+        return src->in_len > 0;
+    }
+    if (!src->head_taken)
+    {
+        src->head_taken = true;
+        src->in = src->head;
+        src->in_len = src->head_len;
+        if (src->in_len > 0)
+            return true;
+    }
+
+    ssize_t n = read(src->fd, src->in_buf, IN_BUF_SIZE);
+    STATS_SYSCALL(SYSCALL_READ);
+    if (n < 0)
+        errexit("Error reading packet", NULL);
+    STATS_BYTES_READ(n);
+    src->in = src->in_buf;
+    src->in_len = n;
+    return n > 0;
+}
+
+
+/**
+ * Marks n bytes of input as consumed.
+*/
+static inline void consume(struct trace_source *src, size_t n)
+{
+    src->in += n;
+    src->in_len -= n;
+}
+
+
+/**
+ * Copies the trace as it is. Reads from a pipe go straight into out.
+*/
+static size_t read_plain(struct trace_source *src, unsigned char *out, size_t cap)
+{
+    if (src->map == NULL && src->head_taken && src->in_len == 0)
+    {
+        ssize_t n = read(src->fd, out, cap);
+        STATS_SYSCALL(SYSCALL_READ);
+        if (n < 0)
+            errexit("Error reading packet", NULL);
+        STATS_BYTES_READ(n);
+        return n;
+    }
+
+    if (!refill(src))
+        return 0;
+    size_t n = src->in_len < cap ? src->in_len : cap;
+    memcpy(out, src->in, n);
+    consume(src, n);
+    return n;
+}
+
+
+/**
+ * Inflates gzip data into out. Concatenated gzip members are read one after another.
+*/
+static size_t read_gzip(struct trace_source *src, unsigned char *out, size_t cap)
+{
+    src->gz.next_out = out;
+    src->gz.avail_out = cap;
+    while (src->gz.avail_out > 0)
+    {
+        if (!refill(src))
+        {
+            if (!src->between_members)
+                errexit("Truncated gzip trace", NULL);
+            break;
+        }
+
+        src->gz.next_in = (Bytef *) src->in;
+        src->gz.avail_in = src->in_len;
+        int ret = inflate(&src->gz, Z_NO_FLUSH);
+        consume(src, src->in_len - src->gz.avail_in);
+        if (ret == Z_STREAM_END)
+        {
+            inflateReset(&src->gz);
+            src->between_members = true;
+        }
+        else if (ret == Z_OK || ret == Z_BUF_ERROR)
+            src->between_members = false;
+        else
+            errexit("Corrupt gzip trace: %s", src->gz.msg != NULL ? src->gz.msg : "inflate failed");
+    }
+    return cap - src->gz.avail_out;
+}
+
+
+#ifdef HAVE_ZSTD
+/**
+ * Decompresses zstd data into out on this thread, frame after frame.
+*/
+static size_t read_zstd(struct trace_source *src, unsigned char *out, size_t cap)
+{
+    ZSTD_outBuffer output = { out, cap, 0 };
+
+    while (output.pos < output.size)
+    {
+        if (!refill(src))
+        {
+            if (!src->between_members)
+                errexit("Truncated zstd trace", NULL);
+            break;
+        }
+
+        ZSTD_inBuffer input = { src->in, src->in_len, 0 };
+        size_t ret = ZSTD_decompressStream(src->zds, &output, &input);
+        if (ZSTD_isError(ret))
+            errexit("Corrupt zstd trace: %s", ZSTD_getErrorName(ret));
+        consume(src, input.pos);
+        src->between_members = (ret == 0);
+    }
+    return output.pos;
+}
+
+
+/**
+ * Decompresses one whole frame into job->out.
+*/
+static void decompress_frame(ZSTD_DCtx *dctx, struct zstd_job *job)
+{
+    unsigned long long size = ZSTD_getFrameContentSize(job->in, job->in_len);
+
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        job->out.resize(size);
+        size_t ret = ZSTD_decompressDCtx(dctx, job->out.data(), size, job->in, job->in_len);
+        if (ZSTD_isError(ret))
+            errexit("Corrupt zstd trace: %s", ZSTD_getErrorName(ret));
+        job->out.resize(ret);
+        return;
+    }
+
+    // Frames that do not record their size grow their output as they go
+    ZSTD_inBuffer input = { job->in, job->in_len, 0 };
+    size_t ret = 1;
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    while (ret != 0)
+    {
+        size_t used = job->out.size();
+        job->out.resize(used + ZSTD_DStreamOutSize());
+        ZSTD_outBuffer output = { job->out.data() + used, ZSTD_DStreamOutSize(), 0 };
+        ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(ret))
+            errexit("Corrupt zstd trace: %s", ZSTD_getErrorName(ret));
+        job->out.resize(used + output.pos);
+        if (ret != 0 && input.pos == input.size && output.pos == 0)
+            errexit("Truncated zstd trace", NULL);
+    }
+}
+
+
+/**
+ * Worker of frame-parallel decompression: takes the oldest frame of the window that
+ * nobody has taken yet, until the source is closed.
+*/
+static void zstd_worker(struct trace_source *src)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+    while (true)
+    {
+        struct zstd_job *job = NULL;
+        {
+            std::unique_lock<std::mutex> guard(src->lock);
+            src->changed.wait(guard, [&]()
+            {
+                for (auto *waiting: src->window)
+                {
+                    if (!waiting->claimed)
+                    {
+                        job = waiting;
+                        return true;
+                    }
+                }
+                return src->stop;
+            });
+            if (job == NULL)
+                break;
+            job->claimed = true;
+        }
+
+        decompress_frame(dctx, job);
+
+        std::lock_guard<std::mutex> guard(src->lock);
+        job->done = true;
+        src->changed.notify_all();
+    }
+    ZSTD_freeDCtx(dctx);
+}
+
+
+/**
+ * Finds the frames of a mapped zstd trace. Returns false if it should rather be streamed:
+ * a single frame, a frame too big to hold in memory, or anything that does not parse
+ * (which streaming then reports).
+*/
+static bool find_frames(struct trace_source *src)
+{
+    size_t off = 0;
+
+    while (off < src->map_len)
+    {
+        size_t len = ZSTD_findFrameCompressedSize(src->map + off, src->map_len - off);
+        if (ZSTD_isError(len))
+            return false;
+        unsigned long long size = ZSTD_getFrameContentSize(src->map + off, len);
+        if (size == ZSTD_CONTENTSIZE_ERROR || (size != ZSTD_CONTENTSIZE_UNKNOWN && size > MAX_PARALLEL_FRAME))
+            return false;
+
+        struct zstd_job job = { src->map + off, len, std::vector<unsigned char>(), 0, false, false };
+        src->frames.push_back(std::move(job));
+        off += len;
+    }
+    return src->frames.size() > 1;
+}
+
+
+/**
+ * Hands out the contents of the frames in order, keeping the window of frames being
+ * decompressed full.
+*/
+static size_t read_zstd_parallel(struct trace_source *src, unsigned char *out, size_t cap)
+{
+    size_t n = 0;
+    size_t max_window = src->workers.size() * FRAMES_PER_THREAD;
+
+    while (n < cap)
+    {
+        std::unique_lock<std::mutex> guard(src->lock);
+        bool added = false;
+        while (src->window.size() < max_window && src->next_frame < src->frames.size())
+        {
+            src->window.push_back(&src->frames[src->next_frame++]);
+            added = true;
+        }
+        if (added)
+            src->changed.notify_all();
+        if (src->window.empty())
+            break;
+
+        struct zstd_job *job = src->window.front();
+        src->changed.wait(guard, [&]() { return job->done; });
+        guard.unlock();
+
+        size_t len = job->out.size() - job->out_pos;
+        if (len > cap - n)
+            len = cap - n;
+        memcpy(out + n, job->out.data() + job->out_pos, len);
+        job->out_pos += len;
+        n += len;
+
+        if (job->out_pos == job->out.size())
+        {
+            std::vector<unsigned char>().swap(job->out);
+            guard.lock();
+            src->window.pop_front();
+        }
+    }
+    return n;
+}
+#endif
+
+
+/**
+ * Opens the byte source of a trace, either a mapping of the whole (compressed) file,
+ * which the source takes over, or fd. threads is how many threads may decompress the
+ * frames of a mapped zstd trace.
+*/
+struct trace_source *open_source(int fd, const unsigned char *map, size_t map_len, int threads)
+{
+    struct trace_source *src = new trace_source();
+
+    src->fd = fd;
+    src->map = map;
+    src->map_len = map_len;
+    if (map != NULL)
+    {
+        src->compression = detect_compression(map, map_len);
+        STATS_BYTES_READ(map_len);
+    }
+    else
+    {
+        if ((src->in_buf = (unsigned char *) malloc(IN_BUF_SIZE)) == NULL)
+            errexit("Out of memory", NULL);
+        while (src->head_len < COMPRESS_MAGIC_SIZE)
+        {
+            ssize_t n = read(fd, src->head + src->head_len, COMPRESS_MAGIC_SIZE - src->head_len);
+            STATS_SYSCALL(SYSCALL_READ);
+            if (n < 0)
+                errexit("Error reading packet", NULL);
+            if (n == 0)
+                break;
+            STATS_BYTES_READ(n);
+            src->head_len += n;
+        }
+        src->compression = detect_compression(src->head, src->head_len);
+    }
+
+    src->between_members = true;
+    if (src->compression == COMPRESS_GZIP && inflateInit2(&src->gz, 16 + MAX_WBITS) != Z_OK)
+        errexit("cannot set up gzip decompression", NULL);
+    if (src->compression == COMPRESS_ZSTD)
+    {
+#ifdef HAVE_ZSTD
+        if (map != NULL && threads > 1 && find_frames(src))
+        {
+            src->parallel = true;
+            for (int i = 0; i < threads; i++)
+                src->workers.push_back(std::thread(zstd_worker, src));
+        }
+        else if ((src->zds = ZSTD_createDStream()) == NULL)
+            errexit("cannot set up zstd decompression", NULL);
+#else
+        errexit("zstd compressed trace; rebuild with make ZSTD=1 for zstd support", NULL);
+#endif
+    }
+    return src;
+}
+
+
+/**
+ * Reads up to cap bytes of the (decompressed) trace into out. Returns 0 only at the end
+ * of the trace.
+*/
+size_t source_read(struct trace_source *src, unsigned char *out, size_t cap)
+{
+    switch (src->compression)
+    {
+        case COMPRESS_GZIP:
+            return read_gzip(src, out, cap);
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+            return src->parallel ? read_zstd_parallel(src, out, cap) : read_zstd(src, out, cap);
+#endif
+        default:
+            return read_plain(src, out, cap);
+    }
+}
+
+
+/**
+ * Stops any decompression threads and releases the source, including its mapping.
+ * The file descriptor is left to the caller.
+*/
+void close_source(struct trace_source *src)
+{
+#ifdef HAVE_ZSTD
+    {
+        std::lock_guard<std::mutex> guard(src->lock);
+        src->stop = true;
+        src->window.clear();
+        src->changed.notify_all();
+    }
+    for (auto &t: src->workers)
+        t.join();
+    if (src->zds != NULL)
+        ZSTD_freeDStream(src->zds);
+#endif
+    if (src->compression == COMPRESS_GZIP)
+        inflateEnd(&src->gz);
+    if (src->map != NULL)
+        munmap((void *) src->map, src->map_len);
+    free(src->in_buf);
+    delete src;
+}
@@ -0,0 +1,23 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+
+#define COMPRESS_MAGIC_SIZE 4       /* bytes that tell the compression formats apart */
+
+/* compression of a trace file, told apart by the magic number at its start */
+enum trace_compression
+{
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD
+};
+
+struct trace_source;
+
+enum trace_compression detect_compression(const unsigned char *head, size_t len);
+struct trace_source *open_source(int fd, const unsigned char *map, size_t map_len, int threads);
+size_t source_read(struct trace_source *src, unsigned char *out, size_t cap);
+void close_source(struct trace_source *src);
+
+#endif
@@ -0,0 +1,388 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: filter.cpp
+ *
+ * Compiler and interpreter for -f packet filter expressions, a subset of the pcap filter
+ * language:
+ *
+ *   expr      := term { ("or" | "||") term }
+ *   term      := factor { ("and" | "&&") factor }
+ *   factor    := ("not" | "!") factor | "(" expr ")" | primitive
+ *   primitive := "ip" | "ip6" | "tcp" | "udp" | "icmp"
+ *              | ["src" | "dst"] ("host" address | "net" address["/"bits] | "port" number)
+ *
+ * Without src or dst a host, net or port primitive matches either side. Expressions are
+ * parsed into a tree, then compiled into jump code the way BPF compilers do: each node is
+ * generated knowing where to jump when it is true and when it is false, so "and", "or"
+ * and "not" cost nothing when the filter runs.
+ * */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <memory>
+#include "filter.h"
+
+/* filter tests */
+enum
+{
+    FOP_IPV4, FOP_IPV6, FOP_TCP, FOP_UDP, FOP_ICMP,
+    FOP_SRC_NET4, FOP_DST_NET4, FOP_SRC_NET6, FOP_DST_NET6,
+    FOP_SRC_PORT, FOP_DST_PORT
+};
+
+/* parse tree node: a test (leaf), or and/or/not of its children */
+struct filter_node
+{
+    enum { LEAF, AND, OR, NOT } kind;
+    struct filter_insn test;
+    std::unique_ptr<struct filter_node> left;
+    std::unique_ptr<struct filter_node> right;
+};
+
+typedef std::unique_ptr<struct filter_node> node_ptr;
+
+/* recursive descent parser state over the tokens of an expression */
+struct filter_parser
+{
+    std::vector<std::string> tokens;
+    size_t pos;
+};
+
+static node_ptr parse_expr(struct filter_parser *p);
+
+
+/**
+ * Splits an expression into words, parentheses and "!".
+*/
+static void tokenize(const char *expr, std::vector<std::string> &tokens)
+{
+    const char *s = expr;
+
+    while (*s != '\0')
+    {
+        if (isspace((unsigned char) *s))
+            s++;
+        else if (*s == '(' || *s == ')' || *s == '!')
+            tokens.push_back(std::string(s++, 1));
+        else
+        {
+            const char *start = s;
+            while (*s != '\0' && !isspace((unsigned char) *s) && *s != '(' && *s != ')')
+                s++;
+            tokens.push_back(std::string(start, s - start));
+        }
+    }
+}
+
+
+/**
+ * Returns the next token without consuming it, or "" at the end.
+*/
+static const std::string &peek(const struct filter_parser *p)
+{
+    static const std::string end;
+    return p->pos < p->tokens.size() ? p->tokens[p->pos] : end;
+}
+
+
+/**
+ * Consumes and returns the next token, which must exist.
+*/
+static const std::string &next_token(struct filter_parser *p, const char *expected)
+{
+    if (p->pos >= p->tokens.size())
+        errexit("Filter expression ends early, expected %s", expected);
+    return p->tokens[p->pos++];
+}
+
+
+static node_ptr make_leaf(uint8_t op)
+{
+    node_ptr node(new filter_node());
+    node->kind = filter_node::LEAF;
+    memset(&node->test, 0x0, sizeof(node->test));
+    node->test.op = op;
+    return node;
+}
+
+
+static node_ptr make_node(int kind, node_ptr left, node_ptr right)
+{
+    node_ptr node(new filter_node());
+    node->kind = (decltype(node->kind)) kind;
+    node->left = std::move(left);
+    node->right = std::move(right);
+    return node;
+}
+
+
+/**
+ * Parses "address" or "address/bits" into a net test on the source (or destination).
+*/
+static node_ptr parse_net(const std::string &arg, bool is_src, bool is_host)
+{
+    std::string addr = arg;
+    int bits = -1;
+    size_t slash = arg.find('/');
+
+    if (slash != std::string::npos)
+    {
+        if (is_host)
+            errexit("A host cannot have a prefix length: %s", arg.c_str());
+        addr = arg.substr(0, slash);
+        char *end;
+        bits = strtol(arg.c_str() + slash + 1, &end, 10);
+        if (*end != '\0' || end == arg.c_str() + slash + 1)
+            errexit("Invalid prefix length: %s", arg.c_str());
+    }
+
+    bool v6 = addr.find(':') != std::string::npos;
+    node_ptr node = make_leaf(v6 ? (is_src ? FOP_SRC_NET6 : FOP_DST_NET6) : (is_src ? FOP_SRC_NET4 : FOP_DST_NET4));
+    struct filter_insn &test = node->test;
+    int addr_bits = v6 ? 128 : 32;
+
+    if (inet_pton(v6 ? AF_INET6 : AF_INET, addr.c_str(), test.addr) != 1)
+        errexit("Invalid address: %s", arg.c_str());
+    if (bits < 0)
+        bits = addr_bits;
+    if (bits > addr_bits)
+        errexit("Invalid prefix length: %s", arg.c_str());
+
+    test.prefix_len = bits;
+    for (int i = 0; i < addr_bits / 8; i++)
+    {
+        int n = bits - i * 8;
+        test.mask[i] = n >= 8 ? 0xff : n <= 0 ? 0 : (0xff << (8 - n)) & 0xff;
+        test.addr[i] &= test.mask[i];
+    }
+    return node;
+}
+
+
+/**
+ * Parses a host, net or port primitive after an optional src or dst qualifier. Without
+ * a qualifier the primitive becomes "src ... or dst ...".
+*/
+static node_ptr parse_qualified(struct filter_parser *p)
+{
+    std::string dir;
+    if (peek(p) == "src" || peek(p) == "dst")
+        dir = next_token(p, "src or dst");
+
+    std::string kind = next_token(p, "host, net or port");
+    if (kind != "host" && kind != "net" && kind != "port")
+        errexit("Expected host, net or port in filter, got %s", kind.c_str());
+    std::string arg = next_token(p, "an address or port");
+
+    node_ptr sides[2];
+    for (int i = 0; i < 2; i++)
+    {
+        bool is_src = i == 0;
+        if (!dir.empty() && (dir == "src") != is_src)
+            continue;
+
+        if (kind == "port")
+        {
+            char *end;
+            long port = strtol(arg.c_str(), &end, 10);
+            if (*end != '\0' || end == arg.c_str() || port < 0 || port > 65535)
+                errexit("Invalid port: %s", arg.c_str());
+            sides[i] = make_leaf(is_src ? FOP_SRC_PORT : FOP_DST_PORT);
+            sides[i]->test.port = port;
+        }
+        else
+            sides[i] = parse_net(arg, is_src, kind == "host");
+    }
+
+    if (sides[0] == nullptr)
+        return std::move(sides[1]);
+    if (sides[1] == nullptr)
+        return std::move(sides[0]);
+    return make_node(filter_node::OR, std::move(sides[0]), std::move(sides[1]));
+}
+
+
+static node_ptr parse_factor(struct filter_parser *p)
+{
+    const std::string &token = peek(p);
+
+    if (token == "not" || token == "!")
+    {
+        p->pos++;
+        return make_node(filter_node::NOT, parse_factor(p), nullptr);
+    }
+    if (token == "(")
+    {
+        p->pos++;
+        node_ptr node = parse_expr(p);
+        if (next_token(p, ")") != ")")
+            errexit("Expected ) in filter, got %s", p->tokens[p->pos - 1].c_str());
+        return node;
+    }
+    if (token == "ip" || token == "ip6" || token == "tcp" || token == "udp" || token == "icmp")
+    {
+        p->pos++;
+        if (token == "ip")
+            return make_leaf(FOP_IPV4);
+        if (token == "ip6")
+            return make_leaf(FOP_IPV6);
+        if (token == "tcp")
+            return make_leaf(FOP_TCP);
+        if (token == "udp")
+            return make_leaf(FOP_UDP);
+        return make_leaf(FOP_ICMP);
+    }
+    return parse_qualified(p);
+}
+
+
+static node_ptr parse_term(struct filter_parser *p)
+{
+    node_ptr node = parse_factor(p);
+    while (peek(p) == "and" || peek(p) == "&&")
+    {
+        p->pos++;
+        node = make_node(filter_node::AND, std::move(node), parse_factor(p));
+    }
+    return node;
+}
+
+
+static node_ptr parse_expr(struct filter_parser *p)
+{
+    node_ptr node = parse_term(p);
+    while (peek(p) == "or" || peek(p) == "||")
+    {
+        p->pos++;
+        node = make_node(filter_node::OR, std::move(node), parse_term(p));
+    }
+    return node;
+}
+
+
+/**
+ * Emits the code of node so that it ends by jumping to on_true or on_false, and returns
+ * the index of its first instruction. Code is emitted back to front, so every jump
+ * target already exists.
+*/
+static uint16_t gen(const struct filter_node &node, uint16_t on_true, uint16_t on_false,
+                    std::vector<struct filter_insn> &code)
+{
+    switch (node.kind)
+    {
+        case filter_node::AND:
+            return gen(*node.left, gen(*node.right, on_true, on_false, code), on_false, code);
+        case filter_node::OR:
+            return gen(*node.left, on_true, gen(*node.right, on_true, on_false, code), code);
+        case filter_node::NOT:
+            return gen(*node.left, on_false, on_true, code);
+        default:
+            break;
+    }
+
+    if (code.size() >= FILTER_REJECT)
+        errexit("Filter expression is too long", NULL);
+    struct filter_insn insn = node.test;
+    insn.jt = on_true;
+    insn.jf = on_false;
+    code.push_back(insn);
+    return code.size() - 1;
+}
+
+
+/**
+ * Compiles a filter expression, exiting with an error if it is malformed.
+*/
+void compile_filter(const char *expr, struct packet_filter *filter)
+{
+    struct filter_parser p;
+
+    tokenize(expr, p.tokens);
+    p.pos = 0;
+    if (p.tokens.empty())
+        errexit("Empty filter expression", NULL);
+
+    node_ptr tree = parse_expr(&p);
+    if (p.pos != p.tokens.size())
+        errexit("Unexpected %s in filter expression", p.tokens[p.pos].c_str());
+
+    filter->code.clear();
+    filter->entry = gen(*tree, FILTER_ACCEPT, FILTER_REJECT, filter->code);
+}
+
+
+/**
+ * Returns whether addr matches the address of a net test, under its mask.
+*/
+static inline bool net_matches(const struct filter_insn &insn, const void *addr, int len)
+{
+    const unsigned char *bytes = (const unsigned char *) addr;
+
+    for (int i = 0; i < len; i++)
+    {
+        if ((bytes[i] & insn.mask[i]) != insn.addr[i])
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Returns the TCP or UDP source (or destination) port of the packet, or -1 if it has neither.
+*/
+static inline int transport_port(const struct pkt_info &pinfo, bool is_src)
+{
+    if (pinfo.tcph() != NULL)
+        return ntohs(is_src ? pinfo.tcph()->th_sport : pinfo.tcph()->th_dport);
+    if (pinfo.udph() != NULL)
+        return ntohs(is_src ? pinfo.udph()->uh_sport : pinfo.udph()->uh_dport);
+    return -1;
+}
+
+
+/**
+ * Runs a single test against the packet.
+*/
+static inline bool run_test(const struct filter_insn &insn, const struct pkt_info &pinfo)
+{
+    switch (insn.op)
+    {
+        case FOP_IPV4: return pinfo.ether_type() == ETHERTYPE_IP;
+        case FOP_IPV6: return pinfo.ether_type() == ETHERTYPE_IPV6 && pinfo.carries_ip();
+        case FOP_TCP: return pinfo.tcph() != NULL;
+        case FOP_UDP: return pinfo.udph() != NULL;
+        case FOP_ICMP:
+            if (pinfo.ip_version() == 4)
+                return pinfo.ip_proto() == IPPROTO_ICMP;
+            return pinfo.ip_version() == 6 && pinfo.ip_proto() == IPPROTO_ICMPV6;
+        case FOP_SRC_NET4: return pinfo.ip_version() == 4 && net_matches(insn, pinfo.ip_src(), 4);
+        case FOP_DST_NET4: return pinfo.ip_version() == 4 && net_matches(insn, pinfo.ip_dst(), 4);
+        case FOP_SRC_NET6: return pinfo.ip_version() == 6 && net_matches(insn, pinfo.ip_src(), 16);
+        case FOP_DST_NET6: return pinfo.ip_version() == 6 && net_matches(insn, pinfo.ip_dst(), 16);
+        case FOP_SRC_PORT: return transport_port(pinfo, true) == insn.port;
+        case FOP_DST_PORT: return transport_port(pinfo, false) == insn.port;
+    }
+    return false;
+}
+
+
+/**
+ * Returns whether the packet passes the filter. Only the headers the tests ask for are
+ * located, and a failed test usually ends the run after one or two instructions.
+*/
+bool filter_match(const struct packet_filter &filter, const struct pkt_info &pinfo)
+{
+    uint16_t pc = filter.entry;
+
+    while (true)
+    {
+        const struct filter_insn &insn = filter.code[pc];
+        pc = run_test(insn, pinfo) ? insn.jt : insn.jf;
+        if (pc >= FILTER_REJECT)
+            return pc == FILTER_ACCEPT;
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <vector>
+#include "next.h"
+
+#define FILTER_ACCEPT 0xffff        /* jump targets that end the program */
+#define FILTER_REJECT 0xfffe
+
+/* one test of a compiled filter, and where to go next depending on its outcome */
+struct filter_insn
+{
+    uint8_t op;                     /* FOP_* in filter.cpp */
+    uint8_t prefix_len;             /* net tests: bits of addr that must match */
+    uint16_t jt;                    /* next instruction if the test holds, or FILTER_ACCEPT/REJECT */
+    uint16_t jf;                    /* next instruction if it does not */
+    uint16_t port;
+    unsigned char addr[16];         /* host and net tests: address, masked to prefix_len */
+    unsigned char mask[16];
+};
+
+/**
+ * Packet filter expression compiled into straight jump code: every instruction is a
+ * single header test, and and/or/not are resolved into its jump targets at compile time.
+*/
+struct packet_filter
+{
+    std::vector<struct filter_insn> code;
+    uint16_t entry;                 /* first instruction to run */
+};
+
+void compile_filter(const char *expr, struct packet_filter *filter);
+bool filter_match(const struct packet_filter &filter, const struct pkt_info &pinfo);
+
+#endif
@@ -0,0 +1,408 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: gen_trace.cpp
+ *
+ * Synthetic trace generator for benchmarking proj4. Writes meta_info records followed by
+ * Ethernet, IPv4 and TCP / UDP / ICMP headers (or an ARP frame for non-IP traffic), with
+ * the packet count, frame size mix, protocol mix and number of hosts given on the command
+ * line. The same arguments and seed always produce the same trace.
+ * */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "next.h"
+
+#define ERROR_PREFIX "ERROR: "
+#define DEFAULT_SIZES "64:50,576:20,1500:30"
+#define DEFAULT_PROTOS "tcp:85,udp:12,icmp:2,arp:1"
+#define DEFAULT_HOSTS 1000
+#define DEFAULT_RATE 100000.0
+#define START_SECS 1667952000       /* 9 November 2022 */
+#define MAX_FRAME_SIZE 1514
+#define ARP_SIZE 28
+#define MAX_HOSTS ((1 << 24) - 2)   /* all of 10.0.0.0/8 */
+#define OUT_BUF_SIZE (1 << 20)
+#define HDR_CLEAR_SIZE (ETHER_HDR_LEN + sizeof(struct ip) + sizeof(struct tcphdr))
+
+/* protocols of the protocol mix */
+enum gen_proto { GEN_TCP, GEN_UDP, GEN_ICMP, GEN_ARP };
+
+/* one entry of a name:weight mix, with the running total of the weights up to it */
+struct mix_entry
+{
+    unsigned int value;
+    double cumulative;
+};
+
+static const unsigned short COMMON_PORTS[] = { 80, 443, 443, 443, 53, 22, 25, 8080, 123, 3306 };
+
+static uint64_t rng_state;
+
+
+/**
+ * Prints the error message and exits.
+ * */
+int errexit(const char *msg_format, const char *arg)
+{
+    fprintf(stderr, ERROR_PREFIX);
+    fprintf(stderr, msg_format, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+
+/**
+ * Prints usage information for this program.
+ * */
+static void usage(char *progname)
+{
+    fprintf(stderr, "%s -n packets [-o trace_file] [-s size_mix] [-P proto_mix] [-H hosts] [-z skew] [-r rate]\n"
+                    "       [-c snaplen] [-S seed]\n", progname);
+    fprintf(stderr, "   -n writes this many packets\n");
+    fprintf(stderr, "   -o writes the trace to trace_file instead of stdout\n");
+    fprintf(stderr, "   -s frame sizes in bytes and their weights (default: %s)\n", DEFAULT_SIZES);
+    fprintf(stderr, "   -P protocols (tcp, udp, icmp, arp) and their weights (default: %s)\n", DEFAULT_PROTOS);
+    fprintf(stderr, "   -H number of hosts, addressed 10.0.0.1 upwards (default: %d)\n", DEFAULT_HOSTS);
+    fprintf(stderr, "   -z Zipf exponent of how often each host is picked (default: 0, uniform)\n");
+    fprintf(stderr, "   -r average packets per second of the timestamps (default: %.0f)\n", DEFAULT_RATE);
+    fprintf(stderr, "   -c captures up to snaplen bytes of each frame (default: headers only)\n");
+    fprintf(stderr, "   -S seed of the random generator (default: 1)\n");
+    exit(1);
+}
+
+
+/**
+ * Returns the next 64 random bits (splitmix64).
+ * */
+static inline uint64_t next_random()
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+
+/**
+ * Returns a random double in [0, 1).
+ * */
+static inline double next_uniform()
+{
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+ * Returns the value of a random entry of the mix, picked by weight.
+ * */
+static unsigned int pick(const std::vector<struct mix_entry> &mix)
+{
+    double x = next_uniform() * mix.back().cumulative;
+    for (const auto &entry: mix)
+        if (x < entry.cumulative)
+            return entry.value;
+    return mix.back().value;
+}
+
+
+/**
+ * Parses a comma separated list of name:weight entries, turning each name into a value
+ * with name_value (which returns false for names it does not know).
+ * */
+static void parse_mix(const char *arg, bool (*name_value)(const std::string &, unsigned int *),
+                      std::vector<struct mix_entry> *mix)
+{
+    std::string list(arg);
+    size_t start = 0;
+    double total = 0;
+
+    while (start <= list.size())
+    {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string item = list.substr(start, end - start);
+        size_t colon = item.find(':');
+        struct mix_entry entry;
+        char *weight_end;
+
+        if (colon == std::string::npos || !name_value(item.substr(0, colon), &entry.value))
+            errexit("Invalid mix: %s", arg);
+        double weight = strtod(item.c_str() + colon + 1, &weight_end);
+        if (weight_end == item.c_str() + colon + 1 || *weight_end != '\0' || weight < 0)
+            errexit("Invalid mix: %s", arg);
+        total += weight;
+        entry.cumulative = total;
+        mix->push_back(entry);
+        start = end + 1;
+    }
+    if (total <= 0)
+        errexit("Invalid mix: %s", arg);
+}
+
+
+static bool size_value(const std::string &name, unsigned int *value)
+{
+    char *end;
+    long size = strtol(name.c_str(), &end, 10);
+
+    *value = (unsigned int) size;
+    return end != name.c_str() && *end == '\0' && size >= ETHER_HDR_LEN && size <= MAX_FRAME_SIZE;
+}
+
+
+static bool proto_value(const std::string &name, unsigned int *value)
+{
+    static const char *const NAMES[] = { "tcp", "udp", "icmp", "arp" };
+
+    for (unsigned int i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); i++)
+        if (name == NAMES[i])
+        {
+            *value = i;
+            return true;
+        }
+    return false;
+}
+
+
+/**
+ * Builds the cumulative Zipf distribution of host popularity: host i is picked in
+ * proportion to 1 / (i + 1)^skew.
+ * */
+static void zipf_table(unsigned int hosts, double skew, std::vector<double> *cdf)
+{
+    double total = 0;
+
+    cdf->resize(hosts);
+    for (unsigned int i = 0; i < hosts; i++)
+    {
+        total += pow(i + 1.0, -skew);
+        (*cdf)[i] = total;
+    }
+}
+
+
+/**
+ * Returns a random host number in [0, hosts), uniform if there is no Zipf table.
+ * */
+static unsigned int pick_host(unsigned int hosts, const std::vector<double> &cdf)
+{
+    if (cdf.empty())
+        return next_random() % hosts;
+    double x = next_uniform() * cdf.back();
+    return std::upper_bound(cdf.begin(), cdf.end(), x) - cdf.begin();
+}
+
+
+/**
+ * Returns the IPv4 address (network byte order) of a host number.
+ * */
+static inline uint32_t host_addr(unsigned int host)
+{
+    return htonl((10u << 24) + host + 1);
+}
+
+
+/**
+ * Writes the Ethernet, IP and transport headers of one frame of the given size to pkt,
+ * and returns how many bytes the headers take. The first HDR_CLEAR_SIZE bytes of pkt
+ * must be zero.
+ * */
+static unsigned int build_frame(unsigned char *pkt, unsigned int proto, unsigned int size,
+                                uint32_t src, uint32_t dst)
+{
+    struct ether_header *eth = (struct ether_header *) pkt;
+    unsigned char *l3 = pkt + ETHER_HDR_LEN;
+
+    memset(eth->ether_dhost, 0x02, ETHER_ADDR_LEN);
+    memset(eth->ether_shost, 0x02, ETHER_ADDR_LEN);
+    memcpy(eth->ether_dhost + 2, &dst, sizeof(dst));
+    memcpy(eth->ether_shost + 2, &src, sizeof(src));
+
+    if (proto == GEN_ARP)
+    {
+        struct arphdr *arp = (struct arphdr *) l3;
+        eth->ether_type = htons(ETHERTYPE_ARP);
+        arp->ar_hrd = htons(ARPHRD_ETHER);
+        arp->ar_pro = htons(ETHERTYPE_IP);
+        arp->ar_hln = ETHER_ADDR_LEN;
+        arp->ar_pln = sizeof(src);
+        arp->ar_op = htons(ARPOP_REQUEST);
+        memcpy(l3 + sizeof(*arp), eth->ether_shost, ETHER_ADDR_LEN);
+        memcpy(l3 + sizeof(*arp) + ETHER_ADDR_LEN, &src, sizeof(src));
+        memcpy(l3 + sizeof(*arp) + 2 * ETHER_ADDR_LEN + sizeof(src), &dst, sizeof(dst));
+        return ETHER_HDR_LEN + ARP_SIZE;
+    }
+
+    struct ip *iph = (struct ip *) l3;
+    unsigned char *l4 = l3 + sizeof(struct ip);
+    unsigned int l4_len = proto == GEN_TCP ? sizeof(struct tcphdr) : proto == GEN_UDP ? sizeof(struct udphdr) : ICMP_MINLEN;
+    unsigned int ip_len = std::max(size - ETHER_HDR_LEN, (unsigned int) sizeof(struct ip) + l4_len);
+
+    eth->ether_type = htons(ETHERTYPE_IP);
+    iph->ip_v = 4;
+    iph->ip_hl = sizeof(struct ip) / 4;
+    iph->ip_len = htons(ip_len);
+    iph->ip_id = htons(next_random() & 0xffff);
+    iph->ip_ttl = 32 + next_random() % 96;
+    iph->ip_p = proto == GEN_TCP ? IPPROTO_TCP : proto == GEN_UDP ? IPPROTO_UDP : IPPROTO_ICMP;
+    iph->ip_sum = 0;
+    iph->ip_src.s_addr = src;
+    iph->ip_dst.s_addr = dst;
+
+    unsigned short service = COMMON_PORTS[next_random() % (sizeof(COMMON_PORTS) / sizeof(COMMON_PORTS[0]))];
+    unsigned short ephemeral = 32768 + next_random() % 28232;
+    if (proto == GEN_TCP)
+    {
+        struct tcphdr *tcph = (struct tcphdr *) l4;
+        uint64_t r = next_random();
+        tcph->th_sport = htons(ephemeral);
+        tcph->th_dport = htons(service);
+        tcph->th_seq = htonl((uint32_t) r);
+        tcph->th_ack = htonl((uint32_t) (r >> 32));
+        tcph->th_off = sizeof(struct tcphdr) / 4;
+        tcph->th_flags = (r & 0xf) == 0 ? TH_SYN : (r & 0xf) == 1 ? TH_FIN | TH_ACK : (r & 0x30) == 0 ? TH_PUSH | TH_ACK : TH_ACK;
+        tcph->th_win = htons(1024 + (r >> 48) % 64512);
+    }
+    else if (proto == GEN_UDP)
+    {
+        struct udphdr *udph = (struct udphdr *) l4;
+        udph->uh_sport = htons(ephemeral);
+        udph->uh_dport = htons(service);
+        udph->uh_ulen = htons(ip_len - sizeof(struct ip));
+    }
+    else
+    {
+        struct icmp *icmph = (struct icmp *) l4;
+        icmph->icmp_type = ICMP_ECHO;
+        icmph->icmp_code = 0;
+        icmph->icmp_id = htons(next_random() & 0xffff);
+        icmph->icmp_seq = htons(next_random() & 0xffff);
+    }
+    return ETHER_HDR_LEN + sizeof(struct ip) + l4_len;
+}
+
+
+int main(int argc, char *argv[])
+{
+    long long num_packets = -1;
+    const char *out_filename = NULL;
+    const char *sizes_arg = DEFAULT_SIZES;
+    const char *protos_arg = DEFAULT_PROTOS;
+    long hosts = DEFAULT_HOSTS;
+    double skew = 0, rate = DEFAULT_RATE;
+    long snaplen = 0;
+    std::vector<struct mix_entry> sizes, protos;
+    std::vector<double> host_cdf;
+    int opt;
+
+    rng_state = 1;
+    while ((opt = getopt(argc, argv, ":n:o:s:P:H:z:r:c:S:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                num_packets = atoll(optarg);
+                if (num_packets < 0)
+                    errexit("Invalid number of packets: %s", optarg);
+                break;
+            case 'o':
+                out_filename = optarg;
+                break;
+            case 's':
+                sizes_arg = optarg;
+                break;
+            case 'P':
+                protos_arg = optarg;
+                break;
+            case 'H':
+                hosts = atol(optarg);
+                if (hosts < 2 || hosts > MAX_HOSTS)
+                    errexit("Invalid number of hosts: %s", optarg);
+                break;
+            case 'z':
+                skew = atof(optarg);
+                if (skew < 0)
+                    errexit("Invalid skew: %s", optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                if (rate <= 0)
+                    errexit("Invalid rate: %s", optarg);
+                break;
+            case 'c':
+                snaplen = atol(optarg);
+                if (snaplen < 0 || snaplen > MAX_PKT_SIZE)
+                    errexit("Invalid snaplen: %s", optarg);
+                break;
+            case 'S':
+                rng_state = strtoull(optarg, NULL, 0);
+                break;
+            case ':':
+                fprintf(stderr, "%sOption %c is missing a value\n", ERROR_PREFIX, optopt);
+                usage(argv[0]);
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_packets < 0 || optind != argc)
+        usage(argv[0]);
+    parse_mix(sizes_arg, size_value, &sizes);
+    parse_mix(protos_arg, proto_value, &protos);
+    if (skew > 0)
+        zipf_table(hosts, skew, &host_cdf);
+
+    FILE *out = out_filename != NULL ? fopen(out_filename, "wb") : stdout;
+    if (out == NULL)
+        errexit("cannot open output file %s", out_filename);
+    setvbuf(out, NULL, _IOFBF, OUT_BUF_SIZE);
+
+    unsigned char record[sizeof(struct meta_info) + MAX_FRAME_SIZE] = {};
+    struct meta_info *meta = (struct meta_info *) record;
+    unsigned char *pkt = record + sizeof(struct meta_info);
+    double now = START_SECS;
+
+    for (long long i = 0; i < num_packets; i++)
+    {
+        unsigned int proto = pick(protos);
+        unsigned int size = pick(sizes);
+        unsigned int src = pick_host(hosts, host_cdf);
+        unsigned int dst = pick_host(hosts, host_cdf);
+        while (dst == src)
+            dst = pick_host(hosts, host_cdf);
+
+        // Only the headers are ever written; the payload stays zero
+        memset(pkt, 0x0, HDR_CLEAR_SIZE);
+        unsigned int hdr_len = build_frame(pkt, proto, size, host_addr(src), host_addr(dst));
+        unsigned int caplen = std::min((unsigned int) std::max((long) hdr_len, snaplen), std::max(size, hdr_len));
+
+        // Exponential gaps between packets, rounded to the microseconds of the format
+        now += -log(1.0 - next_uniform()) / rate;
+        meta->caplen = htons(caplen);
+        meta->ignored = 0;
+        meta->secs = htonl((unsigned int) now);
+        meta->usecs = htonl((unsigned int) ((now - floor(now)) * 1000000));
+        if (fwrite(record, sizeof(struct meta_info) + caplen, 1, out) != 1)
+            errexit("cannot write to %s", out_filename != NULL ? out_filename : "stdout");
+    }
+    if (fclose(out) != 0)
+        errexit("cannot write to %s", out_filename != NULL ? out_filename : "stdout");
+    return 0;
+}
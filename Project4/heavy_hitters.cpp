@@ -0,0 +1,273 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: heavy_hitters.cpp
+ *
+ * Space-Saving (Metwally et al.) over payload bytes. With c counters, any pair whose
+ * true total exceeds N / c bytes (N = all payload bytes seen) is guaranteed to be kept,
+ * and each estimate overshoots by at most the error recorded with it, itself at most N / c.
+ * */
+
+
+#include <algorithm>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include "next.h"
+#include "heavy_hitters.h"
+#include "stats.h"
+
+
+/**
+ * Returns the index slot of a pair's hash: multiplicative hashing of the 64-bit key.
+*/
+static inline size_t hash_key(uint64_t key, size_t mask)
+{
+    return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+}
+
+
+/**
+ * Sets up num_counters empty counters, sized from the command line.
+*/
+void HeavyHitters::init(size_t num_counters)
+{
+    size_t slots = 2;
+
+    capacity = num_counters;
+    total_bytes = 0;
+    heap.clear();
+    heap.reserve(capacity);
+    while (slots < capacity * 2)
+        slots *= 2;
+    index_keys.assign(slots, 0);
+    index_pos.assign(slots, 0);
+    index_mask = slots - 1;
+}
+
+
+/**
+ * Returns the index slot holding key, or the free slot where it would go.
+*/
+size_t HeavyHitters::find_slot(uint64_t key) const
+{
+    size_t i = hash_key(key, index_mask);
+    STATS_COUNT(hash_lookups, 1);
+    STATS_COUNT(hash_probes, 1);
+    while (index_pos[i] != 0 && index_keys[i] != key)
+    {
+        i = (i + 1) & index_mask;
+        STATS_COUNT(hash_probes, 1);
+    }
+    return i;
+}
+
+
+/**
+ * Removes key from the index, shifting later entries of its probe run back so that
+ * lookups never need tombstones.
+*/
+void HeavyHitters::index_erase(uint64_t key)
+{
+    size_t hole = find_slot(key);
+    size_t i = hole;
+
+    index_pos[hole] = 0;
+    while (true)
+    {
+        i = (i + 1) & index_mask;
+        if (index_pos[i] == 0)
+            return;
+        size_t home = hash_key(index_keys[i], index_mask);
+        // Move the entry into the hole unless its home lies cyclically in (hole, i]
+        bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays)
+        {
+            index_keys[hole] = index_keys[i];
+            index_pos[hole] = index_pos[i];
+            index_pos[i] = 0;
+            hole = i;
+        }
+    }
+}
+
+
+/**
+ * Puts counter at heap position i and points the index at it.
+*/
+void HeavyHitters::place(size_t i, const struct hh_counter &counter)
+{
+    heap[i] = counter;
+    index_pos[find_slot(pair_key(counter.src, counter.dst))] = i + 1;
+}
+
+
+void HeavyHitters::sift_up(size_t i)
+{
+    struct hh_counter counter = heap[i];
+    while (i > 0 && heap[(i - 1) / 2].bytes > counter.bytes)
+    {
+        place(i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    place(i, counter);
+}
+
+
+void HeavyHitters::sift_down(size_t i)
+{
+    struct hh_counter counter = heap[i];
+    size_t n = heap.size();
+
+    while (2 * i + 1 < n)
+    {
+        size_t child = 2 * i + 1;
+        if (child + 1 < n && heap[child + 1].bytes < heap[child].bytes)
+            child++;
+        if (heap[child].bytes >= counter.bytes)
+            break;
+        place(i, heap[child]);
+        i = child;
+    }
+    place(i, counter);
+}
+
+
+/**
+ * Counts bytes of payload for the src/dst pair. Pairs without a counter take over the
+ * smallest one, inheriting its total as their error.
+*/
+void HeavyHitters::add(uint32_t src, uint32_t dst, long long bytes)
+{
+    uint64_t key = pair_key(src, dst);
+    size_t slot = find_slot(key);
+
+    total_bytes += bytes;
+    if (index_pos[slot] != 0)
+    {
+        size_t i = index_pos[slot] - 1;
+        heap[i].bytes += bytes;
+        sift_down(i);
+        return;
+    }
+
+    if (heap.size() < capacity)
+    {
+        struct hh_counter counter = { src, dst, bytes, 0 };
+        index_keys[slot] = key;
+        index_pos[slot] = heap.size() + 1;
+        heap.push_back(counter);
+        sift_up(heap.size() - 1);
+        return;
+    }
+
+    struct hh_counter counter = { src, dst, heap[0].bytes + bytes, heap[0].bytes };
+    index_erase(pair_key(heap[0].src, heap[0].dst));
+    slot = find_slot(key);
+    index_keys[slot] = key;
+    index_pos[slot] = 1;
+    heap[0] = counter;
+    sift_down(0);
+}
+
+
+/**
+ * Returns the largest error any pair (tracked or not) can have: the smallest counter
+ * once every counter is in use, 0 before that.
+*/
+long long HeavyHitters::max_error() const
+{
+    return heap.size() < capacity || heap.empty() ? 0 : heap[0].bytes;
+}
+
+
+/**
+ * Replaces the counters with the largest `capacity` of the given ones.
+*/
+void HeavyHitters::rebuild(std::vector<struct hh_counter> &counters)
+{
+    if (counters.size() > capacity)
+    {
+        std::nth_element(counters.begin(), counters.begin() + capacity, counters.end(),
+                         [](const struct hh_counter &a, const struct hh_counter &b) { return a.bytes > b.bytes; });
+        counters.resize(capacity);
+    }
+
+    long long total = total_bytes;
+    init(capacity);
+    total_bytes = total;
+    for (const auto &counter: counters)
+    {
+        size_t slot = find_slot(pair_key(counter.src, counter.dst));
+        index_keys[slot] = pair_key(counter.src, counter.dst);
+        index_pos[slot] = heap.size() + 1;
+        heap.push_back(counter);
+        sift_up(heap.size() - 1);
+    }
+}
+
+
+/**
+ * Merges the summary of another part of the trace into this one. A pair missing from a
+ * full summary may still have up to its smallest counter there, which is added to both
+ * its estimate and its error so that the bounds keep holding.
+*/
+void HeavyHitters::merge(const HeavyHitters &other)
+{
+    long long my_min = max_error();
+    long long other_min = other.max_error();
+    std::unordered_map<uint64_t, struct hh_counter> merged;
+
+    for (const auto &counter: heap)
+    {
+        struct hh_counter c = counter;
+        c.bytes += other_min;
+        c.error += other_min;
+        merged[pair_key(c.src, c.dst)] = c;
+    }
+    for (const auto &counter: other.heap)
+    {
+        auto it = merged.find(pair_key(counter.src, counter.dst));
+        if (it != merged.end())
+        {
+            // Already counted with other_min standing in for the other side's count
+            it->second.bytes += counter.bytes - other_min;
+            it->second.error += counter.error - other_min;
+        }
+        else
+        {
+            struct hh_counter c = counter;
+            c.bytes += my_min;
+            c.error += my_min;
+            merged[pair_key(c.src, c.dst)] = c;
+        }
+    }
+
+    std::vector<struct hh_counter> counters;
+    counters.reserve(merged.size());
+    for (const auto &entry: merged)
+        counters.push_back(entry.second);
+    total_bytes += other.total_bytes;
+    rebuild(counters);
+}
+
+
+/**
+ * Appends the k pairs with the most estimated bytes to out, largest first, ties broken
+ * by address so that the order is stable.
+*/
+void HeavyHitters::top(size_t k, std::vector<struct hh_counter> &out) const
+{
+    std::vector<struct hh_counter> counters(heap);
+
+    std::sort(counters.begin(), counters.end(), [](const struct hh_counter &a, const struct hh_counter &b)
+    {
+        if (a.bytes != b.bytes)
+            return a.bytes > b.bytes;
+        if (a.src != b.src)
+            return ntohl(a.src) < ntohl(b.src);
+        return ntohl(a.dst) < ntohl(b.dst);
+    });
+    if (counters.size() > k)
+        counters.resize(k);
+    out.insert(out.end(), counters.begin(), counters.end());
+}
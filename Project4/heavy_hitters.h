@@ -0,0 +1,54 @@
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define HH_BYTES_PER_COUNTER 56     /* counter plus its share of the hash index */
+
+/* estimated payload bytes of one src/dst pair; the true total is in [bytes - error, bytes] */
+struct hh_counter
+{
+    uint32_t src;
+    uint32_t dst;
+    long long bytes;
+    long long error;
+};
+
+/**
+ * Space-Saving summary of the src/dst pairs with the most payload bytes, in a fixed
+ * number of counters. Counters live in a min-heap by bytes with a linear probing index
+ * from pair to heap slot; a new pair takes over the smallest counter once all are used.
+*/
+class HeavyHitters
+{
+public:
+    HeavyHitters() : capacity(0), total_bytes(0) {}
+
+    void init(size_t num_counters);
+    bool enabled() const { return capacity > 0; }
+    void add(uint32_t src, uint32_t dst, long long bytes);
+    void merge(const HeavyHitters &other);
+    void top(size_t k, std::vector<struct hh_counter> &out) const;
+    long long total() const { return total_bytes; }
+    long long max_error() const;
+
+private:
+    static uint64_t pair_key(uint32_t src, uint32_t dst) { return ((uint64_t) src << 32) | dst; }
+    size_t find_slot(uint64_t key) const;
+    void index_erase(uint64_t key);
+    void sift_up(size_t i);
+    void sift_down(size_t i);
+    void place(size_t i, const struct hh_counter &counter);
+    void rebuild(std::vector<struct hh_counter> &counters);
+
+    size_t capacity;
+    long long total_bytes;
+    std::vector<struct hh_counter> heap;    /* heap[0] has the fewest bytes */
+    std::vector<uint64_t> index_keys;       /* pair of each index slot */
+    std::vector<uint32_t> index_pos;        /* heap position + 1 of each index slot, 0 if free */
+    size_t index_mask;
+};
+
+#endif
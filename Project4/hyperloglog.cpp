@@ -0,0 +1,119 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: hyperloglog.cpp
+ *
+ * HyperLogLog (Flajolet et al.) with the linear counting correction for small
+ * cardinalities. Keys are mixed into 64-bit hashes, so no large range correction is needed.
+ * */
+
+
+#include <math.h>
+#include <algorithm>
+#include "hyperloglog.h"
+
+
+/**
+ * Returns a well mixed 64-bit hash of key (the splitmix64 finalizer).
+*/
+static inline uint64_t mix64(uint64_t key)
+{
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+    return key ^ (key >> 31);
+}
+
+
+/**
+ * Sets up 2^precision empty registers.
+*/
+void HyperLogLog::init(unsigned int p)
+{
+    precision = p;
+    registers.assign((size_t) 1 << p, 0);
+}
+
+
+/**
+ * Adds key: the top precision bits of its hash pick a register, which keeps the longest
+ * run of leading zeros seen in the remaining bits.
+*/
+void HyperLogLog::add(uint64_t key)
+{
+    uint64_t hash = mix64(key);
+    size_t bucket = hash >> (64 - precision);
+    // The guard bit bounds the run at 64 - precision zeros
+    uint64_t rest = (hash << precision) | ((uint64_t) 1 << (precision - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+
+    if (rank > registers[bucket])
+        registers[bucket] = rank;
+}
+
+
+/**
+ * Folds in a sketch of another part of the trace, built with the same precision.
+*/
+void HyperLogLog::merge(const HyperLogLog &other)
+{
+    for (size_t i = 0; i < registers.size(); i++)
+        registers[i] = std::max(registers[i], other.registers[i]);
+}
+
+
+/**
+ * Returns the estimated number of distinct keys added.
+*/
+long long HyperLogLog::estimate() const
+{
+    double m = registers.size();
+    double alpha;
+    double sum = 0;
+    int zeros = 0;
+
+    switch (precision)
+    {
+        case 4: alpha = 0.673; break;
+        case 5: alpha = 0.697; break;
+        case 6: alpha = 0.709; break;
+        default: alpha = 0.7213 / (1 + 1.079 / m); break;
+    }
+    for (uint8_t reg: registers)
+    {
+        sum += ldexp(1.0, -reg);
+        zeros += reg == 0;
+    }
+
+    double estimate = alpha * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * log(m / zeros);
+    return llround(estimate);
+}
+
+
+/**
+ * Appends the precision and registers of the sketch to a snapshot section.
+*/
+void HyperLogLog::save(std::vector<unsigned char> &out) const
+{
+    uint32_t p = precision;
+
+    ckpt_put(out, &p, sizeof(p));
+    ckpt_put(out, registers.data(), registers.size());
+}
+
+
+/**
+ * Folds in a sketch saved by save(). Returns false if it was saved with another precision.
+*/
+bool HyperLogLog::load(struct ckpt_reader *in)
+{
+    uint32_t p;
+    std::vector<uint8_t> saved(registers.size());
+
+    if (!ckpt_get(in, &p, sizeof(p)) || p != precision || !ckpt_get(in, saved.data(), saved.size()))
+        return false;
+    for (size_t i = 0; i < registers.size(); i++)
+        registers[i] = std::max(registers[i], saved[i]);
+    return true;
+}
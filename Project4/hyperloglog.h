@@ -0,0 +1,35 @@
+#ifndef HYPERLOGLOG_H
+#define HYPERLOGLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "checkpoint.h"
+
+#define HLL_MIN_PRECISION 4
+#define HLL_MAX_PRECISION 16
+#define HLL_DEFAULT_PRECISION 12    /* 4 KB of registers, about 1.6% standard error */
+
+/**
+ * HyperLogLog estimate of the number of distinct 64-bit keys added, in 2^precision
+ * one-byte registers. Sketches of the same precision merge by taking register maxima.
+*/
+class HyperLogLog
+{
+public:
+    HyperLogLog() : precision(0) {}
+
+    void init(unsigned int precision);
+    bool enabled() const { return precision > 0; }
+    void add(uint64_t key);
+    void merge(const HyperLogLog &other);
+    long long estimate() const;
+    void save(std::vector<unsigned char> &out) const;
+    bool load(struct ckpt_reader *in);
+
+private:
+    unsigned int precision;
+    std::vector<uint8_t> registers;     /* longest run of leading zeros + 1 seen per bucket */
+};
+
+#endif
@@ -1,5 +1,17 @@
+#ifndef NEXT_H
+#define NEXT_H
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 
 #define MAX_PKT_SIZE        1600
+#define MAX_PCAP_PKT_SIZE   262144  /* largest snaplen pcap tools use */
+#define HDR_PAD_SIZE        128     /* enough for ethernet + max IP + TCP headers */
+#define NO_USECS            0xffffffffu
 
 /* meta information, using same layout as trace file */
 struct meta_info
@@ -10,22 +22,155 @@ struct meta_info
     unsigned int usecs;
 };
 
-/* record of information about the current packet */
+/* view of one packet record, pointing straight into the reader's memory */
+struct pkt_view
+{
+    unsigned int caplen;        /* from meta info, host byte order */
+    unsigned int len;           /* length on the wire, from pcap and pcapng; caplen for meta info */
+    unsigned int secs;          /* from meta info, host byte order */
+    unsigned int usecs;         /* from meta info, host byte order */
+    unsigned int nsecs;         /* nanoseconds past usecs, from nanosecond pcap timestamps */
+    const unsigned char *pkt;   /* caplen bytes of packet contents */
+};
+
+/* layers of a pkt_info that have been looked for, in its located bits */
+#define PKT_ETHER       0x1
+#define PKT_IP          0x2
+#define PKT_TRANSPORT   0x4
+
+/* network layer an ethertype announces, from the ethertype dispatch table */
+#define NET_OTHER       0
+#define NET_IPV4        1
+#define NET_IPV6        2
+#define NET_VLAN        3       /* 802.1Q or 802.1ad tag, followed by another ethertype */
+
+#define IP6_HDR_SIZE    40
+
+/**
+ * Decoded view of the current packet. Only the meta information is filled in up front;
+ * each header is located the first time one of its accessors is called and cached from
+ * then on, so a mode pays only for the layers it reads. Field accessors convert from
+ * network byte order on every call and need the header to be present.
+ * Pass it by reference: the padded copy of truncated headers lives inside.
+*/
 struct pkt_info
 {
-    unsigned short caplen;      /* from meta info */
+    unsigned int caplen;        /* from meta info */
+    unsigned int len;           /* length on the wire, caplen if the trace does not record it */
     double now;                 /* from meta info */
-    unsigned char pkt [MAX_PKT_SIZE];
-    struct ether_header *ethh;  /* ptr to ethernet header, if fully present,
-                                   otherwise NULL */
-    struct ip *iph;          
-    // struct iphdr *iph;          /* ptr to IP header, if fully present, 
-    //                                otherwise NULL */
-    struct tcphdr *tcph;        /* ptr to TCP header, if fully present,
-                                   otherwise NULL */
-    struct udphdr *udph;        /* ptr to UDP header, if fully present,
-                                   otherwise NULL */
+    unsigned int secs;          /* now, split as in the meta info */
+    unsigned int usecs;         /* NO_USECS if now is not a whole number of microseconds */
+    unsigned int nsecs;         /* now past secs, in nanoseconds (pcap and pcapng traces) */
+    const unsigned char *pkt;   /* packet contents (not owned) */
+
+    // Headers, or NULL if not (fully) present
+    const struct ether_header *ethh() const
+    {
+        if (!(located & PKT_ETHER))
+            locate_ether();
+        return eth_hdr;
+    }
+    const struct ip *iph() const
+    {
+        if (!(located & PKT_IP))
+            locate_ip();
+        return ip_hdr;
+    }
+    const struct ip6_hdr *ip6h() const
+    {
+        if (!(located & PKT_IP))
+            locate_ip();
+        return ip6_hdr;
+    }
+    const struct tcphdr *tcph() const
+    {
+        if (!(located & PKT_TRANSPORT))
+            locate_transport();
+        return tcp_hdr;
+    }
+    const struct udphdr *udph() const
+    {
+        if (!(located & PKT_TRANSPORT))
+            locate_transport();
+        return udp_hdr;
+    }
+
+    // Ethertype after any VLAN tags, and whether it announces IPv4 or IPv6
+    unsigned short ether_type() const
+    {
+        if (!(located & PKT_ETHER))
+            locate_ether();
+        return eth_type;
+    }
+    bool carries_ip() const
+    {
+        if (!(located & PKT_ETHER))
+            locate_ether();
+        return net_class == NET_IPV4 || net_class == NET_IPV6;
+    }
+
+    // 4 or 6 if the packet has an IP header, 0 if not
+    unsigned int ip_version() const
+    {
+        if (!(located & PKT_IP))
+            locate_ip();
+        return ip_ver;
+    }
+
+    // IP header fields in host byte order, for either version; lengths include the
+    // IPv4 options or IPv6 extension headers
+    unsigned int ip_len() const
+    {
+        return ip_version() == 4 ? ntohs(ip_hdr->ip_len) : IP6_HDR_SIZE + ntohs(ip6_hdr->ip6_plen);
+    }
+    unsigned int ip_hlen() const { return ip_version() == 4 ? ip_hdr->ip_hl * 4 : l4_off - net_off; }
+    unsigned char ip_proto() const { return ip_version() == 4 ? ip_hdr->ip_p : l4_proto; }
+    unsigned char ip_ttl() const { return ip_version() == 4 ? ip_hdr->ip_ttl : ip6_hdr->ip6_hlim; }
+    const void *ip_src() const
+    {
+        return ip_version() == 4 ? (const void *) &ip_hdr->ip_src : (const void *) &ip6_hdr->ip6_src;
+    }
+    const void *ip_dst() const
+    {
+        return ip_version() == 4 ? (const void *) &ip_hdr->ip_dst : (const void *) &ip6_hdr->ip6_dst;
+    }
+
+    // TCP header fields in host byte order
+    unsigned short th_sport() const { return ntohs(tcph()->th_sport); }
+    unsigned short th_dport() const { return ntohs(tcph()->th_dport); }
+    unsigned short th_win() const { return ntohs(tcph()->th_win); }
+    unsigned int th_seq() const { return ntohl(tcph()->th_seq); }
+    unsigned int th_ack() const { return ntohl(tcph()->th_ack); }
+    unsigned char th_flags() const { return tcph()->th_flags & 0x3f; }
+
+    mutable unsigned int located;   /* PKT_* bits of the layers looked for so far */
+
+private:
+    void locate_ether() const;
+    void locate_ip() const;
+    void locate_transport() const;
+
+    mutable const unsigned char *hdrs;      /* pkt, or pad if headers are cut off */
+    mutable unsigned int hdrs_len;          /* bytes of hdrs that can be read */
+    mutable unsigned int net_off;           /* offset of the IP header, past any VLAN tags */
+    mutable unsigned int l4_off;            /* IPv6: offset past the extension headers */
+    mutable unsigned char l4_proto;         /* IPv6: next header after the extension headers */
+    mutable unsigned char net_class;
+    mutable unsigned char ip_ver;
+    mutable const struct ether_header *eth_hdr;
+    mutable const struct ip *ip_hdr;
+    mutable const struct ip6_hdr *ip6_hdr;
+    mutable const struct tcphdr *tcp_hdr;
+    mutable const struct udphdr *udp_hdr;
+    mutable unsigned short eth_type;
+
+    // Zero-padded copy of truncated packets so headers past caplen read as 0
+    mutable unsigned char pad[HDR_PAD_SIZE];
 };
 
-// void errexit ();
-unsigned short next_packet ();
+int errexit(const char *msg_format, const char *arg);
+void set_ethertypes(bool decode_vlan_ipv6);
+void decode_packet(const struct pkt_view *view, struct pkt_info *pinfo);
+double packet_time(const struct pkt_view *view);
+
+#endif
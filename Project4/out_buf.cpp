@@ -0,0 +1,101 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: out_buf.cpp
+ *
+ * Buffered output for the per-packet modes.
+ * */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "next.h"
+#include "out_buf.h"
+#include "stats.h"
+
+
+/**
+ * Sets up an empty buffer that flushes to fd, or only grows in memory if fd < 0.
+*/
+void out_open(struct out_buf *out, int fd)
+{
+    out->fd = fd;
+    out->len = 0;
+    out->cap = OUT_BUF_SIZE;
+    if ((out->data = (char *) malloc(out->cap)) == NULL)
+        errexit("Out of memory", NULL);
+}
+
+
+/**
+ * Writes everything buffered so far to the file.
+*/
+void out_flush(struct out_buf *out)
+{
+    size_t written = 0;
+
+    if (out->fd < 0)
+        return;
+
+    while (written < out->len)
+    {
+        ssize_t n = write(out->fd, out->data + written, out->len - written);
+        STATS_SYSCALL(SYSCALL_WRITE);
+        if (n < 0)
+            errexit("cannot write output", NULL);
+        written += n;
+    }
+    out->len = 0;
+}
+
+
+/**
+ * Makes room for at least n more bytes, by flushing or, in memory, by growing.
+*/
+void out_grow(struct out_buf *out, size_t n)
+{
+    if (out->fd >= 0)
+    {
+        out_flush(out);
+        if (out->cap >= n)
+            return;
+    }
+
+    while (out->cap - out->len < n)
+        out->cap *= 2;
+    if ((out->data = (char *) realloc(out->data, out->cap)) == NULL)
+        errexit("Out of memory", NULL);
+}
+
+
+/**
+ * Appends len bytes, writing large blocks straight through when the buffer is file backed.
+*/
+void out_write(struct out_buf *out, const char *data, size_t len)
+{
+    if (out->fd >= 0 && len >= out->cap)
+    {
+        struct out_buf direct = { out->fd, (char *) data, len, len };
+        out_flush(out);
+        out_flush(&direct);
+        return;
+    }
+
+    if (out->cap - out->len < len)
+        out_grow(out, len);
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+
+/**
+ * Flushes and frees the buffer.
+*/
+void out_close(struct out_buf *out)
+{
+    out_flush(out);
+    free(out->data);
+    out->data = NULL;
+    out->len = out->cap = 0;
+}
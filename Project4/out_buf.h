@@ -0,0 +1,133 @@
+#ifndef OUT_BUF_H
+#define OUT_BUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define OUT_BUF_SIZE (1 << 20)      /* flush to the file in writes of about this size */
+#define OUT_LINE_MAX 256            /* no single reserve may ask for more than this */
+
+/**
+ * Large reusable output buffer for the per-packet modes. Lines are formatted straight
+ * into the buffer with the fmt_* helpers below and written out in big write() calls.
+ * With fd < 0 the buffer just grows in memory (used for per-chunk output).
+*/
+struct out_buf
+{
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+void out_open(struct out_buf *out, int fd);
+void out_flush(struct out_buf *out);
+void out_close(struct out_buf *out);
+void out_write(struct out_buf *out, const char *data, size_t len);
+void out_grow(struct out_buf *out, size_t n);
+
+
+/**
+ * Returns a pointer where up to n (<= OUT_LINE_MAX) bytes can be formatted.
+*/
+static inline char *out_reserve(struct out_buf *out, size_t n)
+{
+    if (out->cap - out->len < n)
+        out_grow(out, n);
+    return out->data + out->len;
+}
+
+
+/**
+ * Marks everything formatted up to end as written.
+*/
+static inline void out_commit(struct out_buf *out, char *end)
+{
+    out->len = end - out->data;
+}
+
+
+/**
+ * Formats an unsigned integer in decimal, like "%u".
+*/
+static inline char *fmt_uint(char *p, uint32_t v)
+{
+    char tmp[10];
+    int n = 0;
+
+    do
+    {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+
+    while (n > 0)
+        *p++ = tmp[--n];
+    return p;
+}
+
+
+/**
+ * Formats a signed integer in decimal, like "%d".
+*/
+static inline char *fmt_int(char *p, int v)
+{
+    if (v < 0)
+    {
+        *p++ = '-';
+        return fmt_uint(p, 0u - (uint32_t) v);
+    }
+    return fmt_uint(p, v);
+}
+
+
+/**
+ * Formats a secs.usecs timestamp with 6 decimals, like "%f" of now. Out of range
+ * microseconds (which carry into the seconds) fall back to printf formatting of now.
+*/
+static inline char *fmt_ts(char *p, uint32_t secs, uint32_t usecs, double now)
+{
+    if (usecs >= 1000000)
+        return p + snprintf(p, OUT_LINE_MAX, "%f", now);
+
+    p = fmt_uint(p, secs);
+    *p++ = '.';
+    for (int i = 5; i >= 0; i--)
+    {
+        p[i] = '0' + usecs % 10;
+        usecs /= 10;
+    }
+    return p + 6;
+}
+
+
+/**
+ * Formats an IPv4 address in network byte order as a dotted quad, like inet_ntop().
+*/
+static inline char *fmt_ipv4(char *p, const void *addr)
+{
+    const unsigned char *bytes = (const unsigned char *) addr;
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (i > 0)
+            *p++ = '.';
+        p = fmt_uint(p, bytes[i]);
+    }
+    return p;
+}
+
+
+/**
+ * Formats an IPv6 address in network byte order, like inet_ntop().
+*/
+static inline char *fmt_ipv6(char *p, const void *addr)
+{
+    inet_ntop(AF_INET6, addr, p, INET6_ADDRSTRLEN);
+    return p + strlen(p);
+}
+
+#endif
@@ -16,13 +16,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <iostream>
 #include <map>
+#include <set>
 #include <utility>
 #include <iterator>
 #include <unordered_map>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
 
 // Add networking libraries
 #include <fcntl.h>
@@ -33,7 +41,22 @@
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <signal.h>
+#include <dirent.h>
 #include "next.h"
+#include "reader.h"
+#include "traffic_matrix.h"
+#include "out_buf.h"
+#include "trace_index.h"
+#include "heavy_hitters.h"
+#include "hyperloglog.h"
+#include "throughput.h"
+#include "column_export.h"
+#include "filter.h"
+#include "stats.h"
+#include "checkpoint.h"
+#include "window.h"
+#include "rewrite.h"
 #include "arpa/inet.h"
 #include <inttypes.h>
 
@@ -41,16 +64,67 @@
 #define ERROR 1
 #define ERROR_PREFIX "ERROR: "
 #define MICRO_FACTOR 1 / 1000000.0
+#define NANO_FACTOR 1 / 1000000000.0
 #define WORD_SIZE 4
 #define TCP 'T'
 #define UDP 'U'
 #define MISSING '-'
 #define UNKNOWN '?'
+#define CHUNKS_PER_THREAD 4
+#define RELEASE_BEHIND_BYTES (8 << 20)  /* with -M, trace pages read are dropped at most this often */
+#define RELEASE_BEHIND_MIN (256 << 10)  /* and at least this often, a quarter of -M in between */
+#define HH_COUNTERS_PER_K 10
+#define ETHERTYPE_QINQ 0x88a8       /* 802.1ad service tag */
+#define ETHERTYPE_QINQ_OLD 0x9100   /* pre-standard QinQ tag */
+#define VLAN_TAG_SIZE 4
+#define MAX_VLAN_TAGS 4
+#define MAX_IP6_EXTENSIONS 8
 
 using namespace std;
 
-typedef std::pair<std::string, std::string> SrcDstPair;
-typedef map<SrcDstPair, int> TrafficMatrix;
+/* running totals for summary mode */
+struct summary_stats
+{
+    long long total_pkts;
+    long long ip_pkts;
+    double first_pkt;
+    double last_pkt;
+    HyperLogLog distinct_src;   /* with -d, sketches of the IPv4 addresses and pairs seen */
+    HyperLogLog distinct_dst;
+    HyperLogLog distinct_pairs;
+};
+
+/* state of every selected mode during a single pass over the trace */
+struct analysis
+{
+    FILE *summary_out;          /* output of each mode, NULL if the mode is not selected */
+    struct out_buf *length_out;
+    struct out_buf *packet_out;
+    FILE *matrix_out;
+    struct summary_stats summary;
+    TrafficMatrix traffic_matrix;
+    HeavyHitters heavy_hitters;  /* replaces traffic_matrix with -k */
+    SlidingWindow window;       /* replaces traffic_matrix with -w */
+    FILE *series_out;
+    ThroughputSeries series;
+    struct col_writer *export_out;
+    struct trace_rewriter *rewrite_out;
+    const struct packet_filter *filter;  /* if set, only packets matching -f count */
+    bool has_time_range;        /* only packets with time_start <= now <= time_end count */
+    double time_start;
+    double time_end;
+};
+
+/* a byte range of the trace and the results a worker thread produced for it */
+struct chunk_work
+{
+    struct analysis an;
+    struct out_buf length_buf;  /* -l and -p output of the chunk, if selected */
+    struct out_buf packet_buf;
+    struct col_writer export_buf;
+    struct trace_rewriter rewrite_buf;
+    bool done;
+};
 
 // Define option flags
 static bool is_option_t = false;
@@ -59,10 +133,38 @@ static bool is_option_l = false;
 static bool is_option_p = false;
 static bool is_option_m = false;
 static bool is_option_v = false;
-static bool is_single_opt_provided = false;
+static int num_modes = 0;
+static char *OUTPUT_PREFIX = NULL;
+static int num_threads = 1;
+static bool is_option_i = false;
+static bool is_option_T = false;
+static unsigned int index_stride = 0;
+static double time_start = -HUGE_VAL;
+static double time_end = HUGE_VAL;
+static size_t top_k = 0;
+static size_t hh_budget = 0;
+static unsigned int hll_precision = 0;
+static bool is_option_b = false;
+static double bucket_width = 0;
+static char *EXPORT_FILENAME = NULL;
+static bool is_option_E = false;
+static char *FILTER_EXPR = NULL;
+static bool is_option_S = false;
+static char *DENSE_FILENAME = NULL;
+static char *CHECKPOINT_FILENAME = NULL;
+static char *RESUME_FILENAME = NULL;
+static bool is_option_F = false;
+static size_t matrix_budget = 0;
+static double window_width = 0;
+static double window_every = 0;
+static bool is_option_W = false;
+static char *REWRITE_FILENAME = NULL;
+static bool is_rewrite_pcap = false;
+static vector<string> trace_filenames;     /* -t and any further file arguments */
+static unsigned char ethertype_class[65536];    /* NET_* class of every ethertype */
 
 // put ':' in the starting of the string so that program can distinguish between '?' and ':'
-static const char *OPT_STRING = "slpmv:t:";
+static const char *OPT_STRING = "slpmv:t:o:j:i:T:k:B:d:b:x:Ef:SD:C:R:FM:w:WO:";
 static const int ETHER_HEADER_SIZE = sizeof(struct ether_header);
 
 
@@ -71,11 +173,54 @@ static const int ETHER_HEADER_SIZE = sizeof(struct ether_header);
  * */
 void usage(char *progname)
 {
-    fprintf(stderr, "%s -t trace_file -s|-l|-p|-m\n", progname);
+    fprintf(stderr, "%s -t trace_file [trace_file ...] [-s] [-l] [-p] [-m] [-b width] [-x export_file] [-E] [-f filter] [-S] [-o prefix] [-j threads] [-i stride] [-T start:end]\n"
+                    "       [-k top_k [-B budget]] [-D dense_file] [-d precision]\n"
+                    "       [-R snapshot_in] [-C snapshot_out] [-F] [-M budget] [-w window[,every]] [-W]\n"
+                    "       [-O [pcap:]out_trace]\n", progname);
+    fprintf(stderr, "   -t reads the trace (meta_info records, pcap or pcapng) from trace_file, or stdin if -;\n");
+    fprintf(stderr, "      gzip and zstd compressed traces are decompressed on the fly. With several files (or a\n");
+    fprintf(stderr, "      directory of them), the files are processed concurrently, largest first, and merged\n");
+    fprintf(stderr, "      in the order given (directories in name order)\n");
     fprintf(stderr, "   -s specifies the tool should run in \"summary mode\"\n");
     fprintf(stderr, "   -l specifies the tool will run in \"length analysis mode\"\n");
     fprintf(stderr, "   -p specifies the tool will run in \"packet printing mode\"\n");
-    fprintf(stderr, "   -m specifies the tool will run in \"traffic matrix mode\"\n");
+    fprintf(stderr, "   -m specifies the tool will run in \"traffic matrix mode\", in numeric address order\n");
+    fprintf(stderr, "   -b runs \"throughput mode\" over time buckets width seconds wide, one row per bucket:\n");
+    fprintf(stderr, "      start pkts ip_pkts ip_bytes tcp_pkts udp_pkts payload_bytes\n");
+    fprintf(stderr, "   -x exports the decoded header fields of every packet to a columnar binary file\n");
+    fprintf(stderr, "   -O writes the packets that pass -f and -T to out_trace, as meta_info records like the\n");
+    fprintf(stderr, "      input, or as pcap (the default for pcap and pcapng input, or with pcap:)\n");
+    fprintf(stderr, "   -E also decodes IPv6 and 802.1Q / QinQ VLAN tagged frames (default: IPv4 only)\n");
+    fprintf(stderr, "   -f only analyzes packets matching the filter, e.g. \"tcp and dst port 80 and src net 10.162.0.0/16\"\n");
+    fprintf(stderr, "      (ip, ip6, tcp, udp, icmp, [src|dst] host/net/port, and, or, not, parentheses)\n");
+    fprintf(stderr, "   -S prints the time of each stage, packet rate, bytes read, syscalls and hash table\n");
+    fprintf(stderr, "      stats to stderr at exit (only in the instrumented build: make proj4_stats)\n");
+    fprintf(stderr, "   -o writes the output of each mode to prefix-<mode>.out (required with several modes)\n");
+    fprintf(stderr, "   -j processes the trace on the given number of threads (for a compressed trace: the\n");
+    fprintf(stderr, "      threads that decompress its zstd frames; default one per core; for several files:\n");
+    fprintf(stderr, "      the number of files processed at once)\n");
+    fprintf(stderr, "   -F also writes the -s, -m and -b results of each trace file on its own, to\n");
+    fprintf(stderr, "      prefix-<file name>-<mode>.out\n");
+    fprintf(stderr, "   -i builds or updates the timestamp index trace_file.idx, one entry per stride packets\n");
+    fprintf(stderr, "      (-T alone reuses the existing index, or builds one with stride %d)\n", INDEX_STRIDE);
+    fprintf(stderr, "   -T only processes packets with start <= timestamp <= end, using the index (streamed,\n");
+    fprintf(stderr, "      compressed and followed traces are scanned whole instead)\n");
+    fprintf(stderr, "   -k makes -m report only the top_k src/dst pairs by payload bytes, in fixed memory,\n");
+    fprintf(stderr, "      as: src dst bytes error (the true count is in [bytes - error, bytes])\n");
+    fprintf(stderr, "   -B sets the memory for -k, e.g. 64M (default: %d counters per top pair)\n", HH_COUNTERS_PER_K);
+    fprintf(stderr, "   -M caps the memory of the -m pairs, e.g. 256M: beyond it they are spilled to disk\n");
+    fprintf(stderr, "      in sorted runs under $TMPDIR (default /tmp) and merged back at the end\n");
+    fprintf(stderr, "   -w makes -m print the matrix of the last window seconds every so many seconds of trace\n");
+    fprintf(stderr, "      time (default: once per window, which must be a multiple of every), each snapshot headed by: WINDOW start end\n");
+    fprintf(stderr, "   -W follows the trace as it is written to, like tail -f, until interrupted\n");
+    fprintf(stderr, "   -D also writes the -m matrix to dense_file as a dense binary array for heatmaps\n");
+    fprintf(stderr, "      (at most %d hosts)\n", TM_DENSE_MAX_HOSTS);
+    fprintf(stderr, "   -d adds estimated distinct source, destination and pair counts to -s, using\n");
+    fprintf(stderr, "      2^precision byte sketches (%d-%d, %d is about 1.6%% error)\n",
+            HLL_MIN_PRECISION, HLL_MAX_PRECISION, HLL_DEFAULT_PRECISION);
+    fprintf(stderr, "   -R resumes the -s and -m state from a snapshot of earlier segments of the capture,\n");
+    fprintf(stderr, "      so the trace only has to hold the new segment and the output is cumulative\n");
+    fprintf(stderr, "   -C saves the -s and -m state to a snapshot at exit, for a later -R\n");
     exit(1);
 }
 
@@ -93,7 +238,7 @@ void printv(const char *msg_format, char *arg)
 /**
  * Prints error message to stderr and exits the program.
  * */
-int errexit(const char *msg_format, char *arg)
+int errexit(const char *msg_format, const char *arg)
 {
     fprintf(stderr, ERROR_PREFIX);
     fprintf(stderr, msg_format, arg);
@@ -102,10 +247,87 @@ int errexit(const char *msg_format, char *arg)
 }
 
 
+/**
+ * Parses a start:end time range, where either end may be left empty to leave it open.
+ * */
+void parse_time_range(char *range)
+{
+    char *colon = strchr(range, ':');
+    char *end;
+
+    if (colon == NULL)
+        errexit("Time range must be start:end, not %s", range);
+    if (colon != range)
+    {
+        time_start = strtod(range, &end);
+        if (end != colon)
+            errexit("Invalid time range: %s", range);
+    }
+    if (*(colon + 1) != '\0')
+    {
+        time_end = strtod(colon + 1, &end);
+        if (*end != '\0')
+            errexit("Invalid time range: %s", range);
+    }
+}
+
+
+/**
+ * Parses a byte count with an optional K, M or G suffix.
+ * */
+size_t parse_size(char *arg)
+{
+    char *end;
+    double size = strtod(arg, &end);
+
+    switch (*end)
+    {
+        case 'G': case 'g': size *= 1024;   // fall through
+        case 'M': case 'm': size *= 1024;   // fall through
+        case 'K': case 'k': size *= 1024; end++; break;
+    }
+    if (end == arg || *end != '\0' || size < 1)
+        errexit("Invalid size: %s", arg);
+    return (size_t) size;
+}
+
+
+/**
+ * Parses a -w window[,every] argument, both in seconds.
+ * */
+void parse_window(char *arg)
+{
+    char *end;
+
+    window_width = strtod(arg, &end);
+    window_every = window_width;
+    if (*end == ',')
+        window_every = strtod(end + 1, &end);
+    if (end == arg || *end != '\0' || window_width <= 0 || window_every <= 0)
+        errexit("Invalid window: %s", arg);
+    // The window is a ring of whole slices of every seconds each
+    double slices = window_width / window_every;
+    if (window_every > window_width || fabs(slices - round(slices)) > 1e-9 * slices)
+        errexit("Invalid window: %s", arg);
+}
+
+
+/**
+ * Returns how many Space-Saving counters -k and -B ask for: whatever fits in the memory
+ * budget, or HH_COUNTERS_PER_K per requested pair without one.
+ * */
+size_t num_counters()
+{
+    if (hh_budget == 0)
+        return top_k * HH_COUNTERS_PER_K;
+    return hh_budget / HH_BYTES_PER_COUNTER;
+}
+
+
 /**
  * Keeps track of which options are being passed.
  * */
-void parse_args(int argc, char *argv [], char **TRACE_FILENAME) 
+void parse_args(int argc, char *argv []) 
 {
     int opt;
     
@@ -114,33 +336,111 @@ void parse_args(int argc, char *argv [], char **TRACE_FILENAME)
         switch(opt)
         {
             case 't':
-                *TRACE_FILENAME = optarg;
+                trace_filenames.push_back(optarg);
                 is_option_t = true;
                 break;
             case 's':
-                if (is_single_opt_provided)
-                    usage(argv[0]);
-                is_single_opt_provided = true;
+                if (!is_option_s)
+                    num_modes++;
                 is_option_s = true;
                 break;
             case 'l':
-                if (is_single_opt_provided)
-                    usage(argv[0]);
-                is_single_opt_provided = true;
+                if (!is_option_l)
+                    num_modes++;
                 is_option_l = true;
                 break;
             case 'p':
-                if (is_single_opt_provided)
-                    usage(argv[0]);
-                is_single_opt_provided = true;
+                if (!is_option_p)
+                    num_modes++;
                 is_option_p = true;
                 break;
             case 'm':
-                if (is_single_opt_provided)
-                    usage(argv[0]);
-                is_single_opt_provided = true;
+                if (!is_option_m)
+                    num_modes++;
                 is_option_m = true;
                 break;
+            case 'b':
+            {
+                char *end;
+                bucket_width = strtod(optarg, &end);
+                if (end == optarg || *end != '\0' || !isfinite(bucket_width) || bucket_width <= 0)
+                    errexit("Invalid bucket width: %s", optarg);
+                if (!is_option_b)
+                    num_modes++;
+                is_option_b = true;
+                break;
+            }
+            case 'f':
+                FILTER_EXPR = optarg;
+                break;
+            case 'E':
+                is_option_E = true;
+                break;
+            case 'S':
+#ifndef PROJ4_STATS
+                errexit("-S needs the instrumented build: make proj4_stats", NULL);
+#endif
+                is_option_S = true;
+                break;
+            case 'x':
+                EXPORT_FILENAME = optarg;
+                break;
+            case 'o':
+                OUTPUT_PREFIX = optarg;
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                if (num_threads < 1)
+                    errexit("Invalid number of threads: %s", optarg);
+                break;
+            case 'i':
+                if (atoi(optarg) < 1)
+                    errexit("Invalid index stride: %s", optarg);
+                index_stride = atoi(optarg);
+                is_option_i = true;
+                break;
+            case 'T':
+                parse_time_range(optarg);
+                is_option_T = true;
+                break;
+            case 'k':
+                if (atoi(optarg) < 1)
+                    errexit("Invalid number of top pairs: %s", optarg);
+                top_k = atoi(optarg);
+                break;
+            case 'B':
+                hh_budget = parse_size(optarg);
+                break;
+            case 'D':
+                DENSE_FILENAME = optarg;
+                break;
+            case 'C':
+                CHECKPOINT_FILENAME = optarg;
+                break;
+            case 'R':
+                RESUME_FILENAME = optarg;
+                break;
+            case 'F':
+                is_option_F = true;
+                break;
+            case 'M':
+                matrix_budget = parse_size(optarg);
+                break;
+            case 'w':
+                parse_window(optarg);
+                break;
+            case 'W':
+                is_option_W = true;
+                break;
+            case 'O':
+                is_rewrite_pcap = strncmp(optarg, "pcap:", 5) == 0;
+                REWRITE_FILENAME = is_rewrite_pcap ? optarg + 5 : optarg;
+                break;
+            case 'd':
+                if (atoi(optarg) < HLL_MIN_PRECISION || atoi(optarg) > HLL_MAX_PRECISION)
+                    errexit("Invalid HyperLogLog precision: %s", optarg);
+                hll_precision = atoi(optarg);
+                break;
             case 'v':
                 is_option_v = true;
                 break;
@@ -152,44 +452,96 @@ void parse_args(int argc, char *argv [], char **TRACE_FILENAME)
                 usage(argv[0]);
         }
     }
+
+    // Further trace files may follow the options
+    for (int i = optind; i < argc && is_option_t; i++)
+        trace_filenames.push_back(argv[i]);
 }
 
 
 /**
- * Checks if exactly one of the s, l, p, m options is set.
+ * Checks that a trace file and at least one of the s, l, p, m options are set.
+ * Several modes need -o since each one writes to its own file.
  * */
 void check_required_args() 
 {
     if (!is_option_t) {
         errexit("Required option: -t", NULL);
     }
+    if (num_modes == 0 && !is_option_i && EXPORT_FILENAME == NULL && REWRITE_FILENAME == NULL) {
+        errexit("No valid option was provided.", NULL);
+    }
+    if (num_modes > 1 && OUTPUT_PREFIX == NULL) {
+        errexit("Option -o is required when running several modes", NULL);
+    }
+    if ((top_k > 0 || hh_budget > 0) && !is_option_m) {
+        errexit("Options -k and -B only apply to traffic matrix mode (-m)", NULL);
+    }
+    if (DENSE_FILENAME != NULL && (!is_option_m || top_k > 0)) {
+        errexit("Option -D needs traffic matrix mode (-m) without -k", NULL);
+    }
+    if ((CHECKPOINT_FILENAME != NULL || RESUME_FILENAME != NULL)
+        && ((!is_option_s && !is_option_m) || top_k > 0 || is_option_b)) {
+        errexit("Options -C and -R only apply to summary and traffic matrix mode (-s, -m without -k)", NULL);
+    }
+    if (is_option_F && (OUTPUT_PREFIX == NULL || (!is_option_s && !is_option_m && !is_option_b))) {
+        errexit("Option -F needs -o and one of -s, -m or -b", NULL);
+    }
+    if (matrix_budget > 0 && (!is_option_m || top_k > 0 || DENSE_FILENAME != NULL || CHECKPOINT_FILENAME != NULL)) {
+        errexit("Option -M needs traffic matrix mode (-m) without -k, -D or -C", NULL);
+    }
+    if (matrix_budget > 0 && (num_threads > 1 || trace_filenames.size() > 1 || is_option_F)) {
+        errexit("Option -M needs a single trace file processed on one thread", NULL);
+    }
+    if (window_width > 0 && (!is_option_m || top_k > 0 || matrix_budget > 0 || DENSE_FILENAME != NULL
+                             || CHECKPOINT_FILENAME != NULL || RESUME_FILENAME != NULL)) {
+        errexit("Option -w needs traffic matrix mode (-m) without -k, -M, -D, -C or -R", NULL);
+    }
+    if ((window_width > 0 || is_option_W) && (num_threads > 1 || trace_filenames.size() > 1 || is_option_F)) {
+        errexit("Options -w and -W need a single trace file processed on one thread", NULL);
+    }
+    if (is_option_W && (is_option_i || trace_filenames[0] == "-")) {
+        errexit("Option -W follows a trace file, without -i", NULL);
+    }
+    if (REWRITE_FILENAME != NULL && (trace_filenames.size() > 1 || is_option_F)) {
+        errexit("Option -O needs a single trace file", NULL);
+    }
+    if (hll_precision > 0 && !is_option_s) {
+        errexit("Option -d only applies to summary mode (-s)", NULL);
+    }
+    if (hh_budget > 0 && top_k == 0) {
+        errexit("Option -B needs -k", NULL);
+    }
+    if (top_k > 0 && num_counters() < top_k) {
+        errexit("Memory budget too small for the requested number of top pairs", NULL);
+    }
 }
 
 
 /**
- * Returns whether the packet is IPv4 or not.
+ * Returns whether the packet is IPv4 (or, with -E, IPv6) or not.
 */
-bool is_ip(struct pkt_info pinfo)
+bool is_ip(const struct pkt_info &pinfo)
 {
-    return pinfo.ethh->ether_type == ETHERTYPE_IP;
+    return pinfo.carries_ip();
 }
 
 
 /**
  * Returns whether the packet is TCP or not.
 */
-bool is_tcp(struct pkt_info pinfo)
+bool is_tcp(const struct pkt_info &pinfo)
 {
-    return pinfo.iph->ip_p == IPPROTO_TCP;
+    return pinfo.tcph() != NULL;
 }
 
 
 /**
  * Returns whether the packet is UDP or not.
 */
-bool is_udp(struct pkt_info pinfo)
+bool is_udp(const struct pkt_info &pinfo)
 {
-    return pinfo.iph->ip_p == IPPROTO_UDP;
+    return pinfo.udph() != NULL;
 }
 
 
@@ -202,320 +554,1437 @@ int calc_payload_len(int ip_len, int iphl, int trans_hl)
 }
 
 
-/** 
-    fd - an open file to read packets from
-    pinfo - allocated memory to put packet info into for one packet
+/**
+ * Sets up the ethertype dispatch table: IPv4 only, as in the project specification,
+ * or also IPv6 and 802.1Q / 802.1ad (QinQ) VLAN tags.
+*/
+void set_ethertypes(bool decode_vlan_ipv6)
+{
+    memset(ethertype_class, NET_OTHER, sizeof(ethertype_class));
+    ethertype_class[ETHERTYPE_IP] = NET_IPV4;
+    if (decode_vlan_ipv6)
+    {
+        ethertype_class[ETHERTYPE_IPV6] = NET_IPV6;
+        ethertype_class[ETHERTYPE_VLAN] = NET_VLAN;
+        ethertype_class[ETHERTYPE_QINQ] = NET_VLAN;
+        ethertype_class[ETHERTYPE_QINQ_OLD] = NET_VLAN;
+    }
+}
 
-    returns:
-    1 - a packet was read and pinfo is setup for processing the packet
-    0 - we have hit the end of the file and no packet is available 
- */
-unsigned short next_packet(int fd, struct pkt_info *pinfo)
+
+/**
+ * Returns how many bytes of the packet the header accessors read, given where the
+ * network header starts and what it is.
+*/
+static unsigned int min_full_headers(const unsigned char *pkt, unsigned int caplen,
+                                     unsigned int net_off, unsigned char net_class)
 {
-    struct meta_info meta;
-    int bytes_read;
+    if (net_class == NET_IPV6)
+    {
+        unsigned int needed = net_off + IP6_HDR_SIZE;
+        if (caplen < needed)
+            return needed;
+
+        const struct ip6_hdr *ip6h = (const struct ip6_hdr *) (pkt + net_off);
+        if (ip6h->ip6_nxt == IPPROTO_TCP)
+            needed += sizeof(struct tcphdr);
+        else if (ip6h->ip6_nxt == IPPROTO_UDP)
+            needed += sizeof(struct udphdr);
+        return needed;
+    }
 
-    // Clear out memory in both structs
-    memset(pinfo, 0x0, sizeof(struct pkt_info));
-    memset(&meta, 0x0, sizeof(struct meta_info));
+    unsigned int needed = net_off + sizeof(struct ip);
+    if (caplen < needed)
+        return needed;
+
+    const struct ip *iph = (const struct ip *) (pkt + net_off);
+    unsigned int ip_header_size = iph->ip_hl * WORD_SIZE;
+    if (iph->ip_p == IPPROTO_TCP)
+        needed = net_off + ip_header_size + sizeof(struct tcphdr);
+    else if (iph->ip_p == IPPROTO_UDP)
+        needed = net_off + ip_header_size + sizeof(struct udphdr);
+    return needed;
+}
 
-    /* 1. read the meta information (12 bytes) */
-    bytes_read = read(fd, &meta, sizeof(meta));
-    if (bytes_read == 0)
-        return (0);
-    if (bytes_read < sizeof(meta))
-        errexit("cannot read meta information", NULL);
 
-    // 2. Set caplen attribute of pkt_info struct
-    pinfo->caplen = ntohs(meta.caplen);  
+/**
+ * Returns whether an IPv6 next header value is an extension header to skip over.
+*/
+static inline bool is_ip6_extension(unsigned char next_header)
+{
+    switch (next_header)
+    {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_FRAGMENT:
+        case IPPROTO_DSTOPTS:
+        case IPPROTO_AH:
+        case IPPROTO_MH:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/**
+ * Returns the timestamp of the packet in view as seconds.
+*/
+double packet_time(const struct pkt_view *view)
+{
+    if (view->nsecs == 0)
+        return view->secs + (view->usecs * MICRO_FACTOR);
+    return view->secs + ((view->usecs * 1000.0 + view->nsecs) * NANO_FACTOR);
+}
+
 
-    // 3. Set now attribute based on meta.secs & meta.usecs
-    pinfo->now = ntohl(meta.secs) + (ntohl(meta.usecs) * MICRO_FACTOR);
+/**
+ * Sets up pinfo for the packet in view. Headers are only located once a mode asks for
+ * them (see the pkt_info accessors).
+*/
+void decode_packet(const struct pkt_view *view, struct pkt_info *pinfo)
+{
+    // 1. Set caplen and now attributes based on the meta information
+    pinfo->caplen = view->caplen;
+    pinfo->len = view->len;
+    pinfo->secs = view->secs;
+    pinfo->usecs = view->nsecs == 0 ? view->usecs : NO_USECS;
+    pinfo->nsecs = view->usecs * 1000 + view->nsecs;
+    pinfo->now = packet_time(view);
+    pinfo->pkt = view->pkt;
+    pinfo->located = 0;
+}
 
-    if (pinfo->caplen == 0)
-        return (1);
-    if (pinfo->caplen > MAX_PKT_SIZE)
-        errexit("Packet too big", NULL);
 
-    // 3. Read packet contents (caplen bytes)
-    bytes_read = read(fd, pinfo->pkt, pinfo->caplen);
+/**
+ * Locates the ethernet header and, through the ethertype dispatch table, any VLAN tags
+ * and the network layer after them. Headers cut off by caplen must read as zero, so
+ * those are decoded from a padded copy.
+*/
+void pkt_info::locate_ether() const
+{
+    STATS_SCOPE(STAGE_DECODE);
+    located |= PKT_ETHER;
+    eth_hdr = NULL;
+    eth_type = 0;
+    net_class = NET_OTHER;
+    if (caplen < ETHER_HEADER_SIZE)
+        return;
+
+    // Each VLAN tag is a 2 byte tag control field followed by the next ethertype
+    unsigned int off = ETHER_HEADER_SIZE;
+    unsigned short type = ntohs(((const struct ether_header *) pkt)->ether_type);
+    unsigned char cls = ethertype_class[type];
+    for (int tags = 0; cls == NET_VLAN && tags < MAX_VLAN_TAGS && off + VLAN_TAG_SIZE <= caplen; tags++)
+    {
+        type = (pkt[off + 2] << 8) | pkt[off + 3];
+        cls = ethertype_class[type];
+        off += VLAN_TAG_SIZE;
+    }
+    net_off = off;
+    net_class = cls == NET_VLAN ? NET_OTHER : cls;
 
-    // Some error checking
-    if (bytes_read < 0)
-        errexit("Error reading packet", NULL);
-    if (bytes_read < pinfo->caplen)
-        errexit("Unexpected end of file encountered", NULL);
-    if (bytes_read < ETHER_HEADER_SIZE)
-        return (1);
+    hdrs = pkt;
+    hdrs_len = caplen;
+    if (caplen < HDR_PAD_SIZE && caplen < min_full_headers(pkt, caplen, net_off, net_class))
+    {
+        memset(pad, 0x0, HDR_PAD_SIZE);
+        memcpy(pad, pkt, caplen);
+        hdrs = pad;
+        hdrs_len = HDR_PAD_SIZE;
+    }
 
     // a. Set ethernet header (first 14 bytes right after meta info)
-    pinfo->ethh = (struct ether_header *) pinfo->pkt;
-    pinfo->ethh->ether_type = ntohs(pinfo->ethh->ether_type);   // Convert network byte order
+    eth_hdr = (const struct ether_header *) hdrs;
+    eth_type = type;
+}
+
+
+/**
+ * Locates the IP header after the ethernet header and any VLAN tags. For IPv6 this also
+ * walks the extension header chain to find the transport protocol.
+*/
+void pkt_info::locate_ip() const
+{
+    STATS_SCOPE(STAGE_DECODE);
+    located |= PKT_IP;
+    ip_hdr = NULL;
+    ip6_hdr = NULL;
+    ip_ver = 0;
 
     // Ignore anything that is not IP and has nothing beyond ethernet header to process
-    bool is_ip = (pinfo->ethh->ether_type == ETHERTYPE_IP);
-    bool has_only_ethernet_header = (pinfo->caplen == ETHER_HEADER_SIZE);
+    bool is_ip = carries_ip();
+    bool has_only_ethernet_header = (caplen <= net_off);
     if (!is_ip || has_only_ethernet_header)
-        return (1);
+        return;
 
     // b. Set iph to start of IP header by skipping ethernet header (struct ip or struct iphdr)
-    pinfo->iph = (struct ip *) (pinfo->pkt + ETHER_HEADER_SIZE);
-    pinfo->iph->ip_len = ntohs(pinfo->iph->ip_len);
-    int ip_header_size = pinfo->iph->ip_hl * WORD_SIZE;
-
-    if (pinfo->iph->ip_p == IPPROTO_TCP) 
+    if (net_class == NET_IPV4)
     {
-        /* ci. if TCP packet, 
-            set pinfo->tcph to the start of the TCP header
-            setup values in pinfo->tcph, as needed */
-        pinfo->tcph = (struct tcphdr *) (pinfo->pkt + ETHER_HEADER_SIZE + ip_header_size);
-        pinfo->tcph->th_sport = ntohs(pinfo->tcph->th_sport);
-        pinfo->tcph->th_dport = ntohs(pinfo->tcph->th_dport);
-        pinfo->tcph->th_win = ntohs(pinfo->tcph->th_win);
-        pinfo->tcph->th_seq = ntohl(pinfo->tcph->th_seq);
-        pinfo->tcph->th_ack = ntohl(pinfo->tcph->th_ack);
-        pinfo->tcph->th_flags = pinfo->tcph->th_flags & 0x3f;
+        ip_hdr = (const struct ip *) (hdrs + net_off);
+        ip_ver = 4;
+        return;
     }
-    else if (pinfo->iph->ip_p == IPPROTO_UDP) 
+
+    ip6_hdr = (const struct ip6_hdr *) (hdrs + net_off);
+    ip_ver = 6;
+
+    // Extension headers cut off by caplen end the chain, leaving no transport header
+    unsigned int off = net_off + IP6_HDR_SIZE;
+    unsigned char next_header = ip6_hdr->ip6_nxt;
+    for (int i = 0; i < MAX_IP6_EXTENSIONS && is_ip6_extension(next_header) && off + 8 <= hdrs_len; i++)
     {
-        /* cii. if UDP packet, 
-            set pinfo->udph to the start of the UDP header, (NOT: sizeof(struct ip) at the end)
-            setup values in pinfo->udph, as needed */
-        pinfo->udph = (struct udphdr *) (pinfo->pkt + ETHER_HEADER_SIZE + ip_header_size);
+        const unsigned char *ext = hdrs + off;
+        if (next_header == IPPROTO_FRAGMENT)
+            off += 8;
+        else if (next_header == IPPROTO_AH)
+            off += (ext[1] + 2) * 4;
+        else
+            off += (ext[1] + 1) * 8;
+        next_header = ext[0];
     }
-
-    return (1);
+    l4_off = off;
+    l4_proto = next_header;
 }
 
 
 /**
- * Handles -s option by printing a high-level summary of the trace file.
+ * Locates the TCP or UDP header, right after the IP header and its options or
+ * extension headers.
 */
-void summary_mode(int fd, struct pkt_info pinfo)
+void pkt_info::locate_transport() const
 {
-    int total_pkts = 0;
-    int ip_pkts = 0;
-    double first_pkt = 0.0;
-    double last_pkt = 0.0;
+    STATS_SCOPE(STAGE_DECODE);
+    located |= PKT_TRANSPORT;
+    tcp_hdr = NULL;
+    udp_hdr = NULL;
+    if (ip_version() == 0)
+        return;
+
+    unsigned int off = net_off + ip_hlen();
+    unsigned char proto = ip_proto();
+    if (proto == IPPROTO_TCP && off + sizeof(struct tcphdr) <= hdrs_len)
+        tcp_hdr = (const struct tcphdr *) (hdrs + off);
+    else if (proto == IPPROTO_UDP && off + sizeof(struct udphdr) <= hdrs_len)
+        udp_hdr = (const struct udphdr *) (hdrs + off);
+}
 
-    // Start reading packets
-    while (next_packet(fd, &pinfo))
-    {
-        if (total_pkts == 0)
-            first_pkt = pinfo.now;
 
-        last_pkt = pinfo.now;
+/** 
+    tr - an open trace to read packets from
+    pinfo - allocated memory to put packet info into for one packet
 
-        if (pinfo.ethh->ether_type == ETHERTYPE_IP)
-            ip_pkts++;
+    returns:
+    1 - a packet was read and pinfo is setup for processing the packet
+    0 - we have hit the end of the file and no packet is available 
+ */
+unsigned short next_packet(struct trace_reader *tr, struct pkt_info *pinfo)
+{
+    struct pkt_view view;
 
-        total_pkts++;
-    }
+    STATS_PACKET();
+    if (!next_view(tr, &view))
+        return (0);
 
-    printf("FIRST PKT: %f\n", first_pkt);
-    printf("LAST PKT: %f\n", last_pkt);
-    printf("TOTAL PACKETS: %d\n", total_pkts);
-    printf("IP PACKETS: %d\n", ip_pkts);
+    STATS_STAGE(STAGE_DECODE);
+    decode_packet(&view, pinfo);
+    return (1);
 }
 
 
 /**
- * Handles -l option by printing length information about each IPv4 paket in the packet trace file.
- * Format: ts caplen ip_len iphl transport trans_hl payload_len
+ * Returns a 64-bit key for an IP address of the packet: the IPv4 address itself, or the
+ * halves of an IPv6 address folded together.
 */
-void length_mode(int fd, struct pkt_info pinfo)
+static inline uint64_t addr_key(const struct pkt_info &pinfo, const void *addr)
 {
-    while (next_packet(fd, &pinfo) == 1)
-    {
-        // Remember 1 is still returned for non-ip packets
-        if (!is_ip(pinfo))
-            continue;
+    if (pinfo.ip_version() == 4)
+        return ((const struct in_addr *) addr)->s_addr;
 
-        double ts = pinfo.now;
-        int caplen = pinfo.caplen;
+    uint64_t half[2];
+    memcpy(half, addr, sizeof(half));
+    return half[0] * 0x9e3779b97f4a7c15ull ^ half[1];
+}
 
-        if (pinfo.iph == NULL)
-        {
-            printf("%f %d %c %c %c %c %c\n", ts, caplen, MISSING, MISSING, MISSING, MISSING, MISSING);
-            continue;
-        }
-        
-        int ip_len = pinfo.iph->ip_len;
-        int iphl = pinfo.iph->ip_hl * WORD_SIZE;
-        
-        if (is_tcp(pinfo))
-        {
-            // th_off is the data offset
-            if (pinfo.tcph->th_off == 0)
-            {
-                printf("%f %d %d %d %c %c %c\n", ts, caplen, ip_len, iphl, TCP, MISSING, MISSING);
-            }
-            else
-            {
-                int trans_hl = pinfo.tcph->th_off * 4;
-                int payload_len = calc_payload_len(ip_len, iphl, trans_hl);
-                printf("%f %d %d %d %c %d %d\n", ts, caplen, ip_len, iphl, TCP, trans_hl, payload_len);
-            }
-            
-        } 
-        else if (is_udp(pinfo))
-        {
-            bool has_no_udp_header = pinfo.udph->uh_ulen == 0;
-            if (has_no_udp_header)
-            {
-                printf("%f %d %d %d %c %c %c\n", ts, caplen, ip_len, iphl, UDP, MISSING, MISSING);
-            }
-            else
-            {
-                int trans_hl = sizeof(struct udphdr);
-                int payload_len = calc_payload_len(ip_len, iphl, trans_hl);
-                printf("%f %d %d %d %c %d %d\n", ts, caplen, ip_len, iphl, UDP, trans_hl, payload_len);
-            }
-        }
-        else 
-        {
-            printf("%f %d %d %d %c %c %c\n", ts, caplen, ip_len, iphl, UNKNOWN, UNKNOWN, UNKNOWN);
-        }
-    }
+
+/**
+ * Appends an IP address of the packet, formatted like inet_ntop().
+*/
+static inline char *fmt_ip(char *p, const struct pkt_info &pinfo, const void *addr)
+{
+    return pinfo.ip_version() == 4 ? fmt_ipv4(p, addr) : fmt_ipv6(p, addr);
 }
 
 
 /**
- * Handles -p option by printing a single line of information about each TCP packet in the packet trace file.
- * Format: ts | src_ip | dst_ip | ip_tll | src_port | dst_port | window | seqno | ackno
+ * Handles -s option by keeping a high-level summary of the trace file.
 */
-void packet_printing_mode(int fd, struct pkt_info pinfo)
+void summary_mode(struct summary_stats *stats, const struct pkt_info &pinfo)
 {
-    while (next_packet(fd, &pinfo) == 1)
-    {
-        if (!is_ip(pinfo) || !is_tcp(pinfo))
-            continue;
+    if (stats->total_pkts == 0)
+        stats->first_pkt = pinfo.now;
 
-        double ts = pinfo.now;
-        char src_ip[INET_ADDRSTRLEN];
-        char dst_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(pinfo.iph->ip_src), src_ip, INET_ADDRSTRLEN);
-        inet_ntop(AF_INET, &(pinfo.iph->ip_dst), dst_ip, INET_ADDRSTRLEN);
-        int ip_ttl = pinfo.iph->ip_ttl;
-        int src_port = pinfo.tcph->th_sport;
-        int dst_port = pinfo.tcph->th_dport;
-        int window = pinfo.tcph->th_win;
-        int seqno = pinfo.tcph->th_seq;
-        
-        // Check if flags field shows that ACK bit is set to 1
-        if (pinfo.tcph->th_flags & TH_ACK)
-        {
-            int ackno = pinfo.tcph->th_ack;
-            printf("%f %s %s %d %d %d %d %" PRIu32 " %" PRIu32 "\n", ts, src_ip, dst_ip, ip_ttl, src_port, dst_port, window, seqno, ackno);
-        }
+    stats->last_pkt = pinfo.now;
+
+    if (is_ip(pinfo))
+        stats->ip_pkts++;
+
+    if (stats->distinct_pairs.enabled() && pinfo.ip_version() != 0)
+    {
+        uint64_t src = addr_key(pinfo, pinfo.ip_src());
+        uint64_t dst = addr_key(pinfo, pinfo.ip_dst());
+        stats->distinct_src.add(src);
+        stats->distinct_dst.add(dst);
+        if (pinfo.ip_version() == 4)
+            stats->distinct_pairs.add((src << 32) | dst);
         else
-        {
-            printf("%f %s %s %d %d %d %d %" PRIu32 " %c\n", ts, src_ip, dst_ip, ip_ttl, src_port, dst_port, window, seqno, MISSING);
-        }
+            stats->distinct_pairs.add(src * 0x9e3779b97f4a7c15ull + dst);
     }
+
+    stats->total_pkts++;
+}
+
+
+/**
+ * Switches on the distinct address counters of a summary.
+*/
+void init_distinct(struct summary_stats *stats, unsigned int precision)
+{
+    stats->distinct_src.init(precision);
+    stats->distinct_dst.init(precision);
+    stats->distinct_pairs.init(precision);
 }
 
 
 /**
- * Prints the keys and values of the traffic matrix map.
+ * Prints the summary kept by summary_mode().
 */
-void print_traffic_matrix(TrafficMatrix traffic_matrix)
+void print_summary(FILE *out, const struct summary_stats &stats)
 {
-    for (const auto &entry: traffic_matrix)
+    fprintf(out, "FIRST PKT: %f\n", stats.first_pkt);
+    fprintf(out, "LAST PKT: %f\n", stats.last_pkt);
+    fprintf(out, "TOTAL PACKETS: %lld\n", stats.total_pkts);
+    fprintf(out, "IP PACKETS: %lld\n", stats.ip_pkts);
+    if (stats.distinct_pairs.enabled())
     {
-        auto key_pair = entry.first;
-        std::cout << key_pair.first << " " 
-                  << key_pair.second << " "
-                  << entry.second << std::endl;
+        fprintf(out, "DISTINCT SRC IPS: %lld\n", stats.distinct_src.estimate());
+        fprintf(out, "DISTINCT DST IPS: %lld\n", stats.distinct_dst.estimate());
+        fprintf(out, "DISTINCT PAIRS: %lld\n", stats.distinct_pairs.estimate());
     }
 }
 
 
 /**
- * Handles -m option by operating in "traffic matrix mode".
+ * Appends a space and a decimal integer to a line being formatted.
 */
-void traffic_matrix_mode(int fd, struct pkt_info pinfo)
+static inline char *put_int(char *p, int v)
 {
-    TrafficMatrix traffic_matrix;
+    *p++ = ' ';
+    return fmt_int(p, v);
+}
 
-    while (next_packet(fd, &pinfo) == 1)
-    {
-        if (!is_ip(pinfo) || !is_tcp(pinfo))
-            continue;
 
-        bool has_no_tcp_header = pinfo.tcph->th_off == 0;
-        if (has_no_tcp_header) 
-            continue;
+/**
+ * Appends a space and a single character to a line being formatted.
+*/
+static inline char *put_char(char *p, char c)
+{
+    *p++ = ' ';
+    *p++ = c;
+    return p;
+}
+
+
+/**
+ * Handles -l option by printing length information about each IPv4 paket in the packet trace file.
+ * Format: ts caplen ip_len iphl transport trans_hl payload_len
+*/
+void length_mode(struct out_buf *out, const struct pkt_info &pinfo)
+{
+    // Remember 1 is still returned for non-ip packets
+    if (!is_ip(pinfo))
+        return;
 
-        // Keep track of payload length between source and destination ip addresses in traffix_matrix
-        char src_ip[INET_ADDRSTRLEN];
-        char dst_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(pinfo.iph->ip_src), src_ip, INET_ADDRSTRLEN);
-        inet_ntop(AF_INET, &(pinfo.iph->ip_dst), dst_ip, INET_ADDRSTRLEN);
+    char *p = out_reserve(out, OUT_LINE_MAX);
+    p = fmt_ts(p, pinfo.secs, pinfo.usecs, pinfo.now);
+    p = put_int(p, pinfo.caplen);
 
-        int ip_len = pinfo.iph->ip_len;
-        int iphl = pinfo.iph->ip_hl * WORD_SIZE;
-        int trans_hl = pinfo.tcph->th_off * 4;
-        int payload_len = calc_payload_len(ip_len, iphl, trans_hl);
+    if (pinfo.ip_version() == 0)
+    {
+        // ts caplen - - - - -
+        for (int i = 0; i < 5; i++)
+            p = put_char(p, MISSING);
+        *p++ = '\n';
+        out_commit(out, p);
+        return;
+    }
+    
+    int ip_len = pinfo.ip_len();
+    int iphl = pinfo.ip_hlen();
+    p = put_int(p, ip_len);
+    p = put_int(p, iphl);
+    
+    if (is_tcp(pinfo))
+    {
+        p = put_char(p, TCP);
 
-        // Keep track of payload_len traffic between (src_ip, dst_ip) pair
-        SrcDstPair pair = std::make_pair(src_ip, dst_ip);
-        TrafficMatrix::iterator it = traffic_matrix.find(pair);
+        // th_off is the data offset
+        if (pinfo.tcph()->th_off == 0)
+        {
+            p = put_char(p, MISSING);
+            p = put_char(p, MISSING);
+        }
+        else
+        {
+            int trans_hl = pinfo.tcph()->th_off * 4;
+            int payload_len = calc_payload_len(ip_len, iphl, trans_hl);
+            p = put_int(p, trans_hl);
+            p = put_int(p, payload_len);
+        }
+        
+    } 
+    else if (is_udp(pinfo))
+    {
+        p = put_char(p, UDP);
 
-        // Increment payload length if src-dst pair already exists in traffic_matrix
-        if (it != traffic_matrix.end()) 
+        bool has_no_udp_header = pinfo.udph()->uh_ulen == 0;
+        if (has_no_udp_header)
         {
-            it->second += payload_len;
+            p = put_char(p, MISSING);
+            p = put_char(p, MISSING);
         }
-        else 
+        else
         {
-            traffic_matrix.insert(std::make_pair(pair, payload_len));
+            int trans_hl = sizeof(struct udphdr);
+            int payload_len = calc_payload_len(ip_len, iphl, trans_hl);
+            p = put_int(p, trans_hl);
+            p = put_int(p, payload_len);
         }
     }
+    else 
+    {
+        for (int i = 0; i < 3; i++)
+            p = put_char(p, UNKNOWN);
+    }
 
-    print_traffic_matrix(traffic_matrix);
+    *p++ = '\n';
+    out_commit(out, p);
 }
 
 
 /**
- * Main entry point of program.
- * */
-int main(int argc, char *argv[])
+ * Handles -p option by printing a single line of information about each TCP packet in the packet trace file.
+ * Format: ts | src_ip | dst_ip | ip_tll | src_port | dst_port | window | seqno | ackno
+*/
+void packet_printing_mode(struct out_buf *out, const struct pkt_info &pinfo)
 {
-    char *TRACE_FILENAME;
-    int fd;
-    struct pkt_info pinfo = {0};
+    if (!is_ip(pinfo) || !is_tcp(pinfo))
+        return;
+
+    char *p = out_reserve(out, OUT_LINE_MAX);
+    p = fmt_ts(p, pinfo.secs, pinfo.usecs, pinfo.now);
+    *p++ = ' ';
+    p = fmt_ip(p, pinfo, pinfo.ip_src());
+    *p++ = ' ';
+    p = fmt_ip(p, pinfo, pinfo.ip_dst());
+    p = put_int(p, pinfo.ip_ttl());
+    p = put_int(p, pinfo.th_sport());
+    p = put_int(p, pinfo.th_dport());
+    p = put_int(p, pinfo.th_win());
+    *p++ = ' ';
+    p = fmt_uint(p, pinfo.th_seq());
+    
+    // Check if flags field shows that ACK bit is set to 1
+    if (pinfo.th_flags() & TH_ACK)
+    {
+        *p++ = ' ';
+        p = fmt_uint(p, pinfo.th_ack());
+    }
+    else
+    {
+        p = put_char(p, MISSING);
+    }
 
-    printv("Starting project 4...\n", NULL);
-    parse_args(argc, argv, &TRACE_FILENAME);
-    check_required_args();
+    *p++ = '\n';
+    out_commit(out, p);
+}
 
-    // Open trace file
-    if ((fd = open(TRACE_FILENAME, O_RDONLY)) < 0)
-        errexit("cannot open trace file %s", TRACE_FILENAME);
 
-    // Handle single option provided
-    if (is_option_s) 
+/**
+ * Prints the keys and values of the traffic matrix in numeric (src, dst) order.
+ * Each address is converted to text once, however many pairs it is part of.
+*/
+void print_traffic_matrix(FILE *out, TrafficMatrix &traffic_matrix)
+{
+    vector<string> text(traffic_matrix.num_hosts());
+    char buf[INET6_ADDRSTRLEN];
+
+    for (size_t id = 0; id < text.size(); id++)
     {
-        summary_mode(fd, pinfo);
+        const struct tm_host &host = traffic_matrix.host(id);
+        char *end = host.version == 4 ? fmt_ipv4(buf, host.addr) : fmt_ipv6(buf, host.addr);
+        text[id].assign(buf, end - buf);
     }
-    else if (is_option_l) 
+
+    traffic_matrix.for_each_sorted([&](const struct tm_entry &cell)
     {
-        length_mode(fd, pinfo);
-    }
-    else if (is_option_p) 
+        fprintf(out, "%s %s %lld\n", text[cell.src].c_str(), text[cell.dst].c_str(), cell.bytes);
+    });
+}
+
+
+/**
+ * Handles -D by writing the traffic matrix as a dense num_hosts x num_hosts array of
+ * payload bytes for heatmaps: a tm_dense_header, the addresses of the hosts in numeric
+ * order (16 bytes each, IPv4 as ::ffff:a.b.c.d), then the int64 cells row by row.
+*/
+void write_dense_matrix(const char *filename, const TrafficMatrix &traffic_matrix)
+{
+    size_t n = traffic_matrix.num_hosts();
+    if (n > TM_DENSE_MAX_HOSTS)
+        errexit("Too many hosts for a dense matrix file: %s", filename);
+
+    vector<uint32_t> rank;
+    vector<struct tm_entry> cells;
+    vector<size_t> row_start;
+    traffic_matrix.host_ranks(rank);
+    traffic_matrix.sorted_entries(rank, cells, &row_start);
+
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL)
+        errexit("Could not open dense matrix file %s", filename);
+
+    struct tm_dense_header header;
+    memset(&header, 0x0, sizeof(header));
+    memcpy(header.magic, TM_DENSE_MAGIC, sizeof(header.magic));
+    header.num_hosts = n;
+    fwrite(&header, sizeof(header), 1, out);
+
+    vector<unsigned char> addrs(n * 16, 0x0);
+    for (size_t id = 0; id < n; id++)
     {
-        packet_printing_mode(fd, pinfo);
+        const struct tm_host &host = traffic_matrix.host(id);
+        unsigned char *addr = &addrs[rank[id] * 16];
+        if (host.version == 4)
+        {
+            addr[10] = addr[11] = 0xff;
+            memcpy(addr + 12, host.addr, 4);
+        }
+        else
+            memcpy(addr, host.addr, 16);
     }
-    else if (is_option_m) 
+    fwrite(addrs.data(), 1, addrs.size(), out);
+
+    // Rows are written one at a time, so only one row is ever dense in memory
+    vector<int64_t> row(n, 0);
+    for (size_t r = 0; r < n; r++)
     {
-        traffic_matrix_mode(fd, pinfo);
+        for (size_t i = row_start[r]; i < row_start[r + 1]; i++)
+            row[rank[cells[i].dst]] = cells[i].bytes;
+        fwrite(row.data(), sizeof(int64_t), n, out);
+        for (size_t i = row_start[r]; i < row_start[r + 1]; i++)
+            row[rank[cells[i].dst]] = 0;
     }
-    else 
-    {
-        errexit("No valid option was provided.", NULL);
+
+    if (ferror(out) || fclose(out) != 0)
+        errexit("Could not write dense matrix file %s", filename);
+}
+
+
+/**
+ * Sets payload_len to the TCP payload length of the packet as traffic matrix mode counts it.
+ * Returns false for packets the traffic matrix ignores.
+*/
+bool tcp_payload_len(const struct pkt_info &pinfo, int *payload_len)
+{
+    if (!is_ip(pinfo) || !is_tcp(pinfo))
+        return false;
+
+    bool has_no_tcp_header = pinfo.tcph()->th_off == 0;
+    if (has_no_tcp_header) 
+        return false;
+
+    int ip_len = pinfo.ip_len();
+    int iphl = pinfo.ip_hlen();
+    int trans_hl = pinfo.tcph()->th_off * 4;
+    *payload_len = calc_payload_len(ip_len, iphl, trans_hl);
+    return true;
+}
+
+
+/**
+ * Handles -m option by operating in "traffic matrix mode".
+*/
+void traffic_matrix_mode(TrafficMatrix &traffic_matrix, const struct pkt_info &pinfo)
+{
+    int payload_len;
+
+    if (!tcp_payload_len(pinfo, &payload_len))
+        return;
+
+    // Keep track of payload_len traffic between the raw (src_ip, dst_ip) addresses
+    if (pinfo.ip_version() == 4)
+        traffic_matrix.add(pinfo.iph()->ip_src.s_addr, pinfo.iph()->ip_dst.s_addr, payload_len);
+    else
+        traffic_matrix.add6(pinfo.ip_src(), pinfo.ip_dst(), payload_len);
+}
+
+
+/**
+ * Prints a snapshot of the sliding window: a WINDOW start end line, then the traffic
+ * matrix of the window as -m prints it.
+*/
+void print_window(FILE *out, const SlidingWindow &window)
+{
+    TrafficMatrix snapshot;
+
+    window.snapshot(snapshot);
+    fprintf(out, "WINDOW %f %f\n", window.start(), window.end());
+    print_traffic_matrix(out, snapshot);
+    fflush(out);
+}
+
+
+/**
+ * Handles -m with -w by counting the packet in the current slice of the sliding window,
+ * first printing a snapshot for every slice boundary the packet is past.
+*/
+void window_mode(FILE *out, SlidingWindow &window, const struct pkt_info &pinfo)
+{
+    while (window.due(pinfo.now))
+    {
+        print_window(out, window);
+        window.advance(pinfo.now);
+    }
+    traffic_matrix_mode(window.current(pinfo.now), pinfo);
+}
+
+
+/**
+ * Handles -m with -k by keeping only the heaviest src/dst pairs, in fixed memory.
+ * Space-Saving needs non-negative weights, so packets without payload are not counted.
+ * Only IPv4 pairs are tracked.
+*/
+void heavy_hitter_mode(HeavyHitters &heavy_hitters, const struct pkt_info &pinfo)
+{
+    int payload_len;
+
+    if (!tcp_payload_len(pinfo, &payload_len) || payload_len <= 0 || pinfo.ip_version() != 4)
+        return;
+
+    heavy_hitters.add(pinfo.iph()->ip_src.s_addr, pinfo.iph()->ip_dst.s_addr, payload_len);
+}
+
+
+/**
+ * Prints the top_k pairs of the approximate traffic matrix, heaviest first.
+ * Format: src_ip dst_ip bytes error, where the true byte count is in [bytes - error, bytes]
+*/
+void print_heavy_hitters(FILE *out, const HeavyHitters &heavy_hitters, size_t top_k)
+{
+    vector<struct hh_counter> top;
+    char src_ip[INET_ADDRSTRLEN];
+    char dst_ip[INET_ADDRSTRLEN];
+
+    heavy_hitters.top(top_k, top);
+    for (const auto &counter: top)
+    {
+        inet_ntop(AF_INET, &counter.src, src_ip, INET_ADDRSTRLEN);
+        inet_ntop(AF_INET, &counter.dst, dst_ip, INET_ADDRSTRLEN);
+        fprintf(out, "%s %s %lld %lld\n", src_ip, dst_ip, counter.bytes, counter.error);
+    }
+}
+
+
+/**
+ * Handles -b option by counting the packet in the time bucket of its timestamp.
+*/
+void throughput_mode(ThroughputSeries &series, const struct pkt_info &pinfo)
+{
+    struct tp_sample sample = {};
+
+    sample.ip = is_ip(pinfo);
+    if (sample.ip && pinfo.ip_version() != 0)
+    {
+        int ip_len = pinfo.ip_len();
+        int iphl = pinfo.ip_hlen();
+
+        sample.ip_bytes = ip_len;
+        if (is_tcp(pinfo))
+        {
+            sample.tcp = 1;
+            if (pinfo.tcph()->th_off != 0)
+                sample.payload_bytes = calc_payload_len(ip_len, iphl, pinfo.tcph()->th_off * 4);
+        }
+        else if (is_udp(pinfo))
+        {
+            sample.udp = 1;
+            if (pinfo.udph()->uh_ulen != 0)
+                sample.payload_bytes = calc_payload_len(ip_len, iphl, sizeof(struct udphdr));
+        }
+    }
+
+    series.add(pinfo.now, sample);
+}
+
+
+/**
+ * Prints one row per time bucket, from the earliest to the latest packet.
+*/
+void print_throughput(FILE *out, const ThroughputSeries &series)
+{
+    for (size_t i = 0; i < series.size(); i++)
+        fprintf(out, "%f %lld %lld %lld %lld %lld %lld\n", series.bucket_start(i), series.pkts[i],
+                series.ip_pkts[i], series.ip_bytes[i], series.tcp_pkts[i], series.udp_pkts[i],
+                series.payload_bytes[i]);
+}
+
+
+/**
+ * Handles -x option by appending the decoded header fields of the packet to the export.
+*/
+void export_mode(struct col_writer *w, const struct pkt_info &pinfo)
+{
+    struct col_row row = {};
+
+    row.ts = pinfo.now;
+    row.caplen = pinfo.caplen;
+    row.payload_len = -1;
+    if (is_ip(pinfo) && pinfo.ip_version() != 0)
+    {
+        int ip_len = pinfo.ip_len();
+        int iphl = pinfo.ip_hlen();
+
+        row.ip_len = ip_len;
+        row.iphl = iphl;
+        row.protocol = pinfo.ip_proto();
+        if (is_tcp(pinfo))
+        {
+            row.sport = pinfo.th_sport();
+            row.dport = pinfo.th_dport();
+            row.seq = pinfo.th_seq();
+            if (pinfo.th_flags() & TH_ACK)
+                row.ack = pinfo.th_ack();
+            row.window = pinfo.th_win();
+            if (pinfo.tcph()->th_off != 0)
+                row.payload_len = calc_payload_len(ip_len, iphl, pinfo.tcph()->th_off * 4);
+        }
+        else if (is_udp(pinfo))
+        {
+            row.sport = ntohs(pinfo.udph()->uh_sport);
+            row.dport = ntohs(pinfo.udph()->uh_dport);
+            if (pinfo.udph()->uh_ulen != 0)
+                row.payload_len = calc_payload_len(ip_len, iphl, sizeof(struct udphdr));
+        }
+    }
+
+    col_append(w, row);
+}
+
+
+/**
+ * Opens the output file of one mode: <prefix>-<mode>.out, or stdout if no -o prefix was given.
+*/
+FILE *open_mode_output(const char *prefix, char mode)
+{
+    if (prefix == NULL)
+        return stdout;
+
+    string filename = string(prefix) + "-" + mode + ".out";
+    FILE *out = fopen(filename.c_str(), "w");
+    if (out == NULL)
+        errexit("cannot open output file %s", filename.c_str());
+    return out;
+}
+
+
+/**
+ * Feeds every packet of the trace to each selected mode in a single pass, decoding each
+ * packet once. Headers are decoded on demand, so only the fields the modes read are.
+*/
+void scan_packets(struct trace_reader *tr, struct analysis *an)
+{
+    struct pkt_info pinfo;
+    bool matrix = an->matrix_out != NULL && !an->heavy_hitters.enabled() && !an->window.enabled();
+    bool window = an->matrix_out != NULL && an->window.enabled();
+    bool heavy = an->matrix_out != NULL && an->heavy_hitters.enabled();
+    bool aggregates = an->summary_out != NULL || an->matrix_out != NULL || an->series_out != NULL;
+    bool formats = an->length_out != NULL || an->packet_out != NULL || an->export_out != NULL
+                   || an->rewrite_out != NULL;
+#ifdef PROJ4_STATS
+    size_t start_off = tr->off;
+#endif
+
+    STATS_LOOP_BEGIN();
+    while (next_packet(tr, &pinfo) == 1)
+    {
+        STATS_COUNT(packets, 1);
+        if (an->has_time_range || an->filter != NULL)
+            STATS_STAGE(STAGE_FILTER);
+        if (an->has_time_range && (pinfo.now < an->time_start || pinfo.now > an->time_end))
+            continue;
+        if (an->filter != NULL && !filter_match(*an->filter, pinfo))
+            continue;
+
+        // Aggregating and per-packet formatting modes are timed as separate stages
+        if (aggregates)
+            STATS_STAGE(STAGE_AGGREGATE);
+        if (an->summary_out != NULL)
+            summary_mode(&an->summary, pinfo);
+        if (matrix)
+            traffic_matrix_mode(an->traffic_matrix, pinfo);
+        if (window)
+            window_mode(an->matrix_out, an->window, pinfo);
+        if (heavy)
+            heavy_hitter_mode(an->heavy_hitters, pinfo);
+        if (an->series_out != NULL)
+            throughput_mode(an->series, pinfo);
+        if (formats)
+            STATS_STAGE(STAGE_FORMAT);
+        if (an->length_out != NULL)
+            length_mode(an->length_out, pinfo);
+        if (an->packet_out != NULL)
+            packet_printing_mode(an->packet_out, pinfo);
+        if (an->export_out != NULL)
+            export_mode(an->export_out, pinfo);
+        if (an->rewrite_out != NULL)
+            rw_packet(an->rewrite_out, pinfo);
+    }
+    STATS_LOOP_END();
+#ifdef PROJ4_STATS
+    if (tr->map != NULL)
+        STATS_BYTES_READ(tr->off - start_off);
+#endif
+}
+
+
+/**
+ * Prints the results of the modes that report once the whole trace has been seen.
+*/
+void print_results(struct analysis *an)
+{
+    STATS_SCOPE(STAGE_FORMAT);
+    if (an->summary_out != NULL)
+        print_summary(an->summary_out, an->summary);
+    if (an->matrix_out != NULL)
+    {
+        if (an->heavy_hitters.enabled())
+            print_heavy_hitters(an->matrix_out, an->heavy_hitters, top_k);
+        else if (an->window.enabled())
+            print_window(an->matrix_out, an->window);
+        else
+            print_traffic_matrix(an->matrix_out, an->traffic_matrix);
+    }
+    if (an->series_out != NULL)
+        print_throughput(an->series_out, an->series);
+}
+
+
+/**
+ * Runs every selected mode over the trace in a single pass.
+*/
+void run_modes(struct trace_reader *tr, struct analysis *an)
+{
+    scan_packets(tr, an);
+    print_results(an);
+}
+
+
+/**
+ * Folds the summary of a later part of the trace into the summary of the part before it.
+*/
+void merge_summary(struct summary_stats *stats, const struct summary_stats &later)
+{
+    if (later.total_pkts == 0)
+        return;
+    if (stats->total_pkts == 0)
+        stats->first_pkt = later.first_pkt;
+
+    stats->last_pkt = later.last_pkt;
+    stats->total_pkts += later.total_pkts;
+    stats->ip_pkts += later.ip_pkts;
+    if (stats->distinct_pairs.enabled())
+    {
+        stats->distinct_src.merge(later.distinct_src);
+        stats->distinct_dst.merge(later.distinct_dst);
+        stats->distinct_pairs.merge(later.distinct_pairs);
+    }
+}
+
+
+/**
+ * Appends the counters, first/last timestamps and -d sketches of a summary to a snapshot.
+*/
+void save_summary(std::vector<unsigned char> &out, const struct summary_stats &stats)
+{
+    int64_t pkts[2] = { stats.total_pkts, stats.ip_pkts };
+    double times[2] = { stats.first_pkt, stats.last_pkt };
+
+    ckpt_put(out, pkts, sizeof(pkts));
+    ckpt_put(out, times, sizeof(times));
+    stats.distinct_src.save(out);
+    stats.distinct_dst.save(out);
+    stats.distinct_pairs.save(out);
+}
+
+
+/**
+ * Loads the summary saved by save_summary() into an empty summary.
+ * Returns false if the snapshot is malformed or its sketches were built with another -d.
+*/
+bool load_summary(struct ckpt_reader *in, struct summary_stats *stats)
+{
+    int64_t pkts[2];
+    double times[2];
+
+    if (!ckpt_get(in, pkts, sizeof(pkts)) || !ckpt_get(in, times, sizeof(times)))
+        return false;
+    stats->total_pkts = pkts[0];
+    stats->ip_pkts = pkts[1];
+    stats->first_pkt = times[0];
+    stats->last_pkt = times[1];
+    return stats->distinct_src.load(in) && stats->distinct_dst.load(in) && stats->distinct_pairs.load(in);
+}
+
+
+/**
+ * Handles -R by starting the selected modes from the state of the earlier segments of
+ * the capture, before the new segment is scanned.
+*/
+void resume_state(const char *filename, struct analysis *an)
+{
+    struct checkpoint ck;
+
+    load_checkpoint(filename, &ck);
+    if (an->summary_out != NULL)
+    {
+        auto section = ck.sections.find(CKPT_SUMMARY);
+        if (section == ck.sections.end())
+            errexit("The snapshot %s has no summary state (-s)", filename);
+        struct ckpt_reader in = { section->second.data(), section->second.data() + section->second.size() };
+        if (!load_summary(&in, &an->summary))
+            errexit("The summary state in %s is damaged or was saved with another -d", filename);
+    }
+    if (an->matrix_out != NULL)
+    {
+        auto section = ck.sections.find(CKPT_MATRIX);
+        if (section == ck.sections.end())
+            errexit("The snapshot %s has no traffic matrix state (-m)", filename);
+        struct ckpt_reader in = { section->second.data(), section->second.data() + section->second.size() };
+        if (!an->traffic_matrix.load(&in))
+            errexit("The traffic matrix state in %s is damaged", filename);
+    }
+}
+
+
+/**
+ * Handles -C by saving the state of the selected modes, including any resumed state.
+*/
+void checkpoint_state(const char *filename, const struct analysis *an)
+{
+    struct checkpoint ck;
+
+    if (an->summary_out != NULL)
+        save_summary(ck.sections[CKPT_SUMMARY], an->summary);
+    if (an->matrix_out != NULL)
+        an->traffic_matrix.save(ck.sections[CKPT_MATRIX]);
+    save_checkpoint(filename, &ck);
+}
+
+
+/**
+ * Sets up the in-memory buffer that a worker writes its share of a per-packet mode into.
+*/
+struct out_buf *open_chunk_output(struct out_buf *mode_out, struct out_buf *buf)
+{
+    if (mode_out == NULL)
+        return NULL;
+
+    out_open(buf, -1);
+    return buf;
+}
+
+
+/**
+ * Appends a finished chunk's share of a per-packet mode to the mode's output.
+*/
+void write_chunk_output(struct out_buf *mode_out, struct out_buf *chunk_out)
+{
+    if (mode_out == NULL)
+        return;
+
+    out_write(mode_out, chunk_out->data, chunk_out->len);
+    out_close(chunk_out);
+}
+
+
+/**
+ * Sets up the analysis of one chunk (or file) with the same modes and options as an.
+ * Aggregate modes only need to be switched on; per-packet modes write to memory.
+*/
+void init_chunk(struct chunk_work *chunk, const struct analysis *an)
+{
+    chunk->an.summary_out = an->summary_out;
+    chunk->an.matrix_out = an->matrix_out;
+    chunk->an.series_out = an->series_out;
+    if (an->series_out != NULL)
+        chunk->an.series.init(bucket_width);
+    chunk->an.filter = an->filter;
+    chunk->an.has_time_range = an->has_time_range;
+    chunk->an.time_start = an->time_start;
+    chunk->an.time_end = an->time_end;
+    if (an->heavy_hitters.enabled())
+        chunk->an.heavy_hitters.init(num_counters());
+    if (an->summary.distinct_pairs.enabled())
+        init_distinct(&chunk->an.summary, hll_precision);
+    chunk->an.length_out = open_chunk_output(an->length_out, &chunk->length_buf);
+    chunk->an.packet_out = open_chunk_output(an->packet_out, &chunk->packet_buf);
+    if (an->export_out != NULL)
+    {
+        col_open(&chunk->export_buf, NULL);
+        chunk->an.export_out = &chunk->export_buf;
+    }
+    if (an->rewrite_out != NULL)
+    {
+        rw_open_chunk(&chunk->rewrite_buf, an->rewrite_out);
+        chunk->an.rewrite_out = &chunk->rewrite_buf;
+    }
+}
+
+
+/**
+ * Appends the per-packet output of a finished chunk to an's and merges its aggregates
+ * into an's, which must hold everything before the chunk.
+*/
+void merge_chunk(struct analysis *an, struct chunk_work *chunk)
+{
+    STATS_STAGE(STAGE_FORMAT);
+    write_chunk_output(an->length_out, &chunk->length_buf);
+    write_chunk_output(an->packet_out, &chunk->packet_buf);
+    if (an->export_out != NULL)
+        col_append_writer(an->export_out, &chunk->export_buf);
+    if (an->rewrite_out != NULL)
+        rw_append_writer(an->rewrite_out, &chunk->rewrite_buf);
+
+    STATS_STAGE(STAGE_AGGREGATE);
+    merge_summary(&an->summary, chunk->an.summary);
+    an->traffic_matrix.merge(chunk->an.traffic_matrix);
+    chunk->an.traffic_matrix.clear();
+    if (an->heavy_hitters.enabled())
+        an->heavy_hitters.merge(chunk->an.heavy_hitters);
+    if (an->series_out != NULL)
+        an->series.merge(chunk->an.series);
+    STATS_STAGE(STAGE_OTHER);
+}
+
+
+/**
+ * Replaces every directory in the list of trace files with the trace files in it, in
+ * name order. Hidden files and -i index sidecars are left out.
+*/
+void expand_trace_dirs(vector<string> *filenames)
+{
+    vector<string> expanded;
+
+    for (const auto &name: *filenames)
+    {
+        struct stat st;
+        if (name == "-" || stat(name.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            expanded.push_back(name);
+            continue;
+        }
+
+        DIR *dir = opendir(name.c_str());
+        if (dir == NULL)
+            errexit("cannot open trace directory %s", name.c_str());
+
+        vector<string> entries;
+        struct dirent *entry;
+        size_t suffix_len = strlen(INDEX_SUFFIX);
+        while ((entry = readdir(dir)) != NULL)
+        {
+            string file = entry->d_name;
+            string path = name + "/" + file;
+            if (file[0] == '.' || (file.size() > suffix_len && file.compare(file.size() - suffix_len, suffix_len, INDEX_SUFFIX) == 0))
+                continue;
+            if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                entries.push_back(path);
+        }
+        closedir(dir);
+
+        if (entries.empty())
+            errexit("no trace files in directory %s", name.c_str());
+        std::sort(entries.begin(), entries.end());
+        expanded.insert(expanded.end(), entries.begin(), entries.end());
+    }
+    filenames->swap(expanded);
+}
+
+
+/**
+ * Returns the last path component of a trace file name, which names its -F outputs.
+*/
+string trace_basename(const string &filename)
+{
+    size_t slash = filename.rfind('/');
+    return filename.substr(slash == string::npos ? 0 : slash + 1);
+}
+
+
+/**
+ * Exits if two trace files have the same base name, as their -F outputs would collide.
+*/
+void check_distinct_basenames(const vector<string> &filenames)
+{
+    set<string> seen;
+
+    for (const auto &name: filenames)
+        if (!seen.insert(trace_basename(name)).second)
+            errexit("Option -F needs trace files with distinct names, %s is given twice", trace_basename(name).c_str());
+}
+
+
+/**
+ * Handles -i and -T for one open trace: brings its index up to date and, with -T, narrows
+ * the trace down to the indexed blocks that can hold the time range. A trace that is not
+ * mapped cannot be indexed, so -T alone just leaves it to the scan to drop packets outside
+ * the range.
+*/
+void narrow_trace(const char *trace_filename, struct trace_reader *tr)
+{
+    if (!is_option_i && (!is_option_T || tr->map == NULL))
+        return;
+
+    struct trace_index idx;
+    update_index(trace_filename, tr, index_stride, &idx);
+    if (is_option_T)
+    {
+        uint64_t begin, end;
+        find_time_range(&idx, time_start, time_end, &begin, &end);
+        seek_trace(tr, begin);
+        tr->end = end;
+    }
+}
+
+
+/**
+ * Runs every selected mode over a memory-mapped trace on num_threads worker threads.
+ * The trace is split into chunks on record boundaries, each chunk is scanned on its own,
+ * and the per-chunk results are merged in trace order so the output is identical to
+ * run_modes().
+*/
+void run_modes_parallel(struct trace_reader *tr, struct analysis *an, int num_threads)
+{
+    int max_chunks = num_threads * CHUNKS_PER_THREAD;
+    vector<struct trace_reader> chunk_trs(max_chunks);
+    int num_chunks = split_trace(tr, max_chunks, &chunk_trs[0]);
+    vector<struct chunk_work> chunks(num_chunks);
+    std::atomic<int> next_chunk(0);
+    std::mutex done_lock;
+    std::condition_variable chunk_done;
+
+    auto worker = [&]()
+    {
+        int i;
+        STATS_THREAD_START();
+        while ((i = next_chunk++) < num_chunks)
+        {
+            struct chunk_work &chunk = chunks[i];
+
+            init_chunk(&chunk, an);
+            scan_packets(&chunk_trs[i], &chunk.an);
+
+            std::lock_guard<std::mutex> guard(done_lock);
+            chunk.done = true;
+            chunk_done.notify_all();
+        }
+        STATS_THREAD_DONE();
+    };
+
+    vector<std::thread> workers;
+    for (int t = 0; t < num_threads; t++)
+        workers.push_back(std::thread(worker));
+
+    // Merge chunks in trace order as soon as each one is finished
+    for (int i = 0; i < num_chunks; i++)
+    {
+        struct chunk_work &chunk = chunks[i];
+        {
+            std::unique_lock<std::mutex> guard(done_lock);
+            chunk_done.wait(guard, [&]() { return chunk.done; });
+        }
+
+        merge_chunk(an, &chunk);
+    }
+
+    for (auto &t: workers)
+        t.join();
+
+    print_results(an);
+}
+
+
+/**
+ * Sets up the buffered output of a per-packet mode on top of its output file.
+*/
+struct out_buf *open_mode_buffer(FILE *file, struct out_buf *buf)
+{
+    if (file == NULL)
+        return NULL;
+
+    // Nothing may be left in stdio's buffer once writes go around it
+    fflush(file);
+    out_open(buf, fileno(file));
+    return buf;
+}
+
+
+/**
+ * Flushes and closes the output file of one mode, if it is open.
+*/
+void close_mode_output(FILE *out)
+{
+    if (out == NULL)
+        return;
+    if (fflush(out) != 0 || (out != stdout && fclose(out) != 0))
+        errexit("cannot write output", NULL);
+}
+
+
+/**
+ * Handles -F by printing the aggregate results of one trace file on their own, to
+ * <prefix>-<file name>-<mode>.out.
+*/
+void print_file_results(const string &trace_filename, struct analysis *file_an)
+{
+    string prefix = string(OUTPUT_PREFIX) + "-" + trace_basename(trace_filename);
+    FILE *summary_out = file_an->summary_out;
+    FILE *matrix_out = file_an->matrix_out;
+    FILE *series_out = file_an->series_out;
+
+    file_an->summary_out = summary_out != NULL ? open_mode_output(prefix.c_str(), 's') : NULL;
+    file_an->matrix_out = matrix_out != NULL ? open_mode_output(prefix.c_str(), 'm') : NULL;
+    file_an->series_out = series_out != NULL ? open_mode_output(prefix.c_str(), 'b') : NULL;
+    print_results(file_an);
+    close_mode_output(file_an->summary_out);
+    close_mode_output(file_an->matrix_out);
+    close_mode_output(file_an->series_out);
+    file_an->summary_out = summary_out;
+    file_an->matrix_out = matrix_out;
+    file_an->series_out = series_out;
+}
+
+
+/**
+ * Runs every selected mode over several trace files on num_threads worker threads, one
+ * file per worker at a time. The files are handed out largest first so that a big one
+ * does not start last and hold up the end of the run; their results are merged in the
+ * order the files were given, as if they had been one trace.
+*/
+void run_files_parallel(const vector<string> &filenames, struct analysis *an, int num_threads)
+{
+    size_t num_files = filenames.size();
+    vector<struct chunk_work> files(num_files);
+    vector<off_t> sizes(num_files, 0);
+    vector<size_t> order(num_files);
+    std::atomic<size_t> next_file(0);
+    std::mutex done_lock;
+    std::condition_variable file_done;
+
+    for (size_t i = 0; i < num_files; i++)
+    {
+        struct stat st;
+        if (stat(filenames[i].c_str(), &st) == 0)
+            sizes[i] = st.st_size;
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    auto worker = [&]()
+    {
+        size_t next;
+        STATS_THREAD_START();
+        while ((next = next_file++) < num_files)
+        {
+            size_t i = order[next];
+            struct chunk_work &file = files[i];
+            struct trace_reader tr;
+
+            init_chunk(&file, an);
+            if (!open_trace(filenames[i].c_str(), &tr))
+                errexit("cannot open trace file %s", filenames[i].c_str());
+            narrow_trace(filenames[i].c_str(), &tr);
+            scan_packets(&tr, &file.an);
+            close_trace(&tr);
+
+            std::lock_guard<std::mutex> guard(done_lock);
+            file.done = true;
+            file_done.notify_all();
+        }
+        STATS_THREAD_DONE();
+    };
+
+    vector<std::thread> workers;
+    for (size_t t = 0; t < (size_t) num_threads && t < num_files; t++)
+        workers.push_back(std::thread(worker));
+
+    // Merge files in the given order as soon as each one is finished
+    for (size_t i = 0; i < num_files; i++)
+    {
+        struct chunk_work &file = files[i];
+        {
+            std::unique_lock<std::mutex> guard(done_lock);
+            file_done.wait(guard, [&]() { return file.done; });
+        }
+
+        if (is_option_F)
+            print_file_results(filenames[i], &file.an);
+        merge_chunk(an, &file);
+        file.an = analysis();
+    }
+
+    for (auto &t: workers)
+        t.join();
+
+    print_results(an);
+}
+
+
+/**
+ * Ends -W at the data read so far, so that the results are still printed.
+*/
+void stop_on_signal(int)
+{
+    stop_following();
+}
+
+
+/**
+ * Main entry point of program.
+ * */
+int main(int argc, char *argv[])
+{
+    struct trace_reader tr;
+    struct analysis an = {};
+    FILE *length_file, *packet_file;
+    struct out_buf length_buf, packet_buf;
+    struct col_writer export_file;
+    struct trace_rewriter rewrite_file;
+    struct packet_filter filter;
+
+    STATS_START();
+    printv("Starting project 4...\n", NULL);
+    parse_args(argc, argv);
+    check_required_args();
+    set_ethertypes(is_option_E);
+    if (FILTER_EXPR != NULL)
+    {
+        compile_filter(FILTER_EXPR, &filter);
+        an.filter = &filter;
+    }
+
+    // Several files (or a directory) are each opened by the worker that processes them
+    expand_trace_dirs(&trace_filenames);
+    if (is_option_F)
+        check_distinct_basenames(trace_filenames);
+    bool several_files = trace_filenames.size() > 1 || is_option_F;
+    if (several_files)
+    {
+        if (num_threads > 1)
+            set_decompress_threads(1);
+    }
+    else
+    {
+        const char *trace_filename = trace_filenames[0].c_str();
+        if (num_threads > 1)
+            set_decompress_threads(num_threads);
+        if (is_option_W)
+        {
+            if (!open_trace_follow(trace_filename, &tr))
+                errexit("cannot follow trace file %s", trace_filename);
+            signal(SIGINT, stop_on_signal);
+            signal(SIGTERM, stop_on_signal);
+        }
+        else if (!open_trace(trace_filename, &tr))
+            errexit("cannot open trace file %s", trace_filename);
+        narrow_trace(trace_filename, &tr);
+    }
+    if (is_option_T)
+    {
+        an.has_time_range = true;
+        an.time_start = time_start;
+        an.time_end = time_end;
+    }
+
+    if (top_k > 0)
+        an.heavy_hitters.init(num_counters());
+    if (window_width > 0)
+        an.window.init(window_width, window_every);
+    if (matrix_budget > 0)
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        an.traffic_matrix.set_budget(matrix_budget, tmpdir != NULL ? tmpdir : "/tmp");
+        set_release_behind(&tr, std::max((size_t) RELEASE_BEHIND_MIN,
+                                          std::min((size_t) RELEASE_BEHIND_BYTES, matrix_budget / 4)));
+    }
+    if (hll_precision > 0)
+        init_distinct(&an.summary, hll_precision);
+
+    // Open an output for each selected mode
+    an.summary_out = is_option_s ? open_mode_output(OUTPUT_PREFIX, 's') : NULL;
+    length_file = is_option_l ? open_mode_output(OUTPUT_PREFIX, 'l') : NULL;
+    packet_file = is_option_p ? open_mode_output(OUTPUT_PREFIX, 'p') : NULL;
+    an.length_out = open_mode_buffer(length_file, &length_buf);
+    an.packet_out = open_mode_buffer(packet_file, &packet_buf);
+    an.matrix_out = is_option_m ? open_mode_output(OUTPUT_PREFIX, 'm') : NULL;
+    an.series_out = is_option_b ? open_mode_output(OUTPUT_PREFIX, 'b') : NULL;
+    if (is_option_b)
+        an.series.init(bucket_width);
+    if (EXPORT_FILENAME != NULL)
+    {
+        col_open(&export_file, EXPORT_FILENAME);
+        an.export_out = &export_file;
+    }
+    if (REWRITE_FILENAME != NULL)
+    {
+        rw_open(&rewrite_file, REWRITE_FILENAME, is_rewrite_pcap || tr.format != FORMAT_META, &tr);
+        an.rewrite_out = &rewrite_file;
     }
 
-    close(fd);
+    if (RESUME_FILENAME != NULL)
+        resume_state(RESUME_FILENAME, &an);
+
+    // Only a memory-mapped trace can be split into chunks up front
+    if (several_files)
+        run_files_parallel(trace_filenames, &an, num_threads);
+    else if (num_threads > 1 && tr.map != NULL)
+        run_modes_parallel(&tr, &an, num_threads);
+    else
+        run_modes(&tr, &an);
+    if (DENSE_FILENAME != NULL)
+        write_dense_matrix(DENSE_FILENAME, an.traffic_matrix);
+    if (CHECKPOINT_FILENAME != NULL)
+        checkpoint_state(CHECKPOINT_FILENAME, &an);
+
+    close_mode_output(an.summary_out);
+    if (an.length_out != NULL)
+        out_close(an.length_out);
+    if (an.packet_out != NULL)
+        out_close(an.packet_out);
+    close_mode_output(length_file);
+    close_mode_output(packet_file);
+    close_mode_output(an.matrix_out);
+    close_mode_output(an.series_out);
+    if (an.export_out != NULL)
+        col_close(an.export_out);
+    if (an.rewrite_out != NULL)
+        rw_close(an.rewrite_out);
+    if (!several_files)
+        close_trace(&tr);
+#ifdef PROJ4_STATS
+    if (is_option_S)
+        print_stats(stderr);
+#endif
     exit(0);
 }
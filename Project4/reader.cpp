@@ -0,0 +1,911 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: reader.cpp
+ *
+ * Trace file reader for meta_info traces and for pcap and pcapng captures, told apart by
+ * the magic number at the start of the file. Regular files are memory-mapped and packets are handed out as views
+ * straight into the mapping, so reading a packet costs no system calls and no copies.
+ * Anything that cannot be mapped (stdin, pipes, FIFOs), and gzip or zstd compressed traces,
+ * are read by a producer thread into a bounded ring of large buffers, which it refills
+ * (decompressing as it goes) while the packets of the others are handed out.
+ * */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include "reader.h"
+#include "decompress.h"
+#include "stats.h"
+
+#define STREAM_BUF_SIZE (4 << 20)   /* bytes read into a stream buffer per refill */
+#define STREAM_BUFS 4               /* buffers in the ring between producer and consumer */
+#define FOLLOW_WAKEUP_MS 250        /* how often a follower waiting for data checks for a stop */
+#define STREAM_PREFIX (1 << 19)     /* room before the data for a record split across buffers */
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 1
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_SHB_SIZE 28          /* block sizes without options or packet data */
+#define PCAPNG_IDB_SIZE 20
+#define PCAPNG_EPB_SIZE 32
+#define PCAPNG_SPB_SIZE 16
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_TSRESOL 9
+
+static const size_t META_SIZE = sizeof(struct meta_info);
+static std::atomic<bool> follow_stopped(false);
+static int decompress_threads = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+
+/* ring-buffered reading of an unmappable or compressed trace */
+struct stream_state
+{
+    struct trace_source *source;
+    unsigned char *bufs[STREAM_BUFS];   /* STREAM_PREFIX bytes of carry-over room, then the data */
+    size_t len[STREAM_BUFS];    /* bytes of data read into each buffer */
+    bool full[STREAM_BUFS];     /* buffer holds data the consumer has not handed back */
+    bool eof;                   /* the producer hit end of file */
+    bool stop;                  /* the reader is being closed */
+    bool started;               /* the consumer has taken its first buffer */
+    int notify_fd;              /* inotify watch of a followed trace, -1 if not following */
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread producer;
+
+    int cur;                    /* buffer the consumer is reading from */
+    size_t pos;                 /* consumer position in the current buffer */
+    size_t end;                 /* end of the data in the current buffer */
+};
+
+
+/**
+ * Blocks until a followed trace has been written to, or until following is stopped.
+ * Returns false once it is stopped.
+*/
+static bool wait_for_growth(struct stream_state *st)
+{
+    struct pollfd pfd = { st->notify_fd, POLLIN, 0 };
+    char events[4096];
+
+    while (!follow_stopped && !st->stop)
+    {
+        int ready = poll(&pfd, 1, FOLLOW_WAKEUP_MS);
+        STATS_SYSCALL(SYSCALL_OTHER);
+        if (ready > 0)
+        {
+            // Only the wakeup matters, not which events were queued
+            while (read(st->notify_fd, events, sizeof(events)) > 0)
+                STATS_SYSCALL(SYSCALL_READ);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Producer side of a stream: fills the buffers of the ring in turn as the consumer
+ * hands them back, until end of file or until the reader is closed. A followed trace
+ * has no end of file: a partly filled buffer is handed over as soon as the file has no
+ * more to give, and an empty one waits for the file to grow.
+*/
+static void stream_fill(struct stream_state *st)
+{
+    int k = 0;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(st->lock);
+            st->changed.wait(guard, [&]() { return !st->full[k] || st->stop; });
+            if (st->stop)
+                return;
+        }
+
+        // Fill the data region of the buffer while the consumer drains the others
+        unsigned char *data = st->bufs[k] + STREAM_PREFIX;
+        size_t len = 0;
+        bool eof = false;
+        while (len < STREAM_BUF_SIZE)
+        {
+            size_t bytes_read = source_read(st->source, data + len, STREAM_BUF_SIZE - len);
+            if (bytes_read == 0 && st->notify_fd >= 0 && len == 0 && wait_for_growth(st))
+                continue;
+            if (bytes_read == 0)
+            {
+                eof = st->notify_fd < 0 || len == 0;
+                break;
+            }
+            len += bytes_read;
+        }
+
+        std::lock_guard<std::mutex> guard(st->lock);
+        st->len[k] = len;
+        st->full[k] = true;
+        st->eof = eof;
+        st->changed.notify_all();
+        if (eof)
+            return;
+        k = (k + 1) % STREAM_BUFS;
+    }
+}
+
+
+/**
+ * Consumer side of a stream: moves on to the next filled buffer, carrying the partial
+ * record left at the end of the current one over into the next buffer's prefix.
+ * Returns false at end of file.
+*/
+static bool stream_next_buffer(struct stream_state *st)
+{
+    int next = (st->cur + 1) % STREAM_BUFS;
+    size_t left = st->end - st->pos;
+
+    std::unique_lock<std::mutex> guard(st->lock);
+    if (st->eof && !st->full[next])
+        return false;
+    st->changed.wait(guard, [&]() { return st->full[next]; });
+
+    if (left > STREAM_PREFIX)
+        errexit("Packet too big", NULL);
+    unsigned char *start = st->bufs[next] + STREAM_PREFIX - left;
+    memmove(start, st->bufs[st->cur] + st->pos, left);
+
+    // Hand the drained buffer back to the producer
+    if (st->started)
+        st->full[st->cur] = false;
+    st->started = true;
+    st->changed.notify_all();
+
+    st->cur = next;
+    st->pos = start - st->bufs[next];
+    st->end = STREAM_PREFIX + st->len[next];
+    return st->len[next] > 0;
+}
+
+
+/**
+ * Returns a pointer to the next n bytes of the trace without consuming them.
+ * avail receives how many of them exist, which is less than n only at end of file.
+*/
+static const unsigned char *peek_bytes(struct trace_reader *tr, size_t n, size_t *avail)
+{
+    if (tr->map != NULL)
+    {
+        *avail = tr->end - tr->off < n ? tr->end - tr->off : n;
+        return tr->map + tr->off;
+    }
+
+    struct stream_state *st = tr->stream;
+    while (st->end - st->pos < n && stream_next_buffer(st))
+        ;
+    *avail = st->end - st->pos < n ? st->end - st->pos : n;
+    return st->bufs[st->cur] + st->pos;
+}
+
+
+/**
+ * Consumes n bytes that were just peeked at.
+*/
+static void skip_bytes(struct trace_reader *tr, size_t n)
+{
+    if (tr->map != NULL)
+        tr->off += n;
+    else
+        tr->stream->pos += n;
+}
+
+
+/**
+ * Consumes the next n bytes without looking at them, however many buffers they span.
+ * Returns false if the trace ends first.
+*/
+static bool discard_bytes(struct trace_reader *tr, size_t n)
+{
+    if (tr->map != NULL)
+    {
+        if (tr->end - tr->off < n)
+            return false;
+        tr->off += n;
+        return true;
+    }
+
+    struct stream_state *st = tr->stream;
+    while (true)
+    {
+        size_t here = st->end - st->pos < n ? st->end - st->pos : n;
+        st->pos += here;
+        n -= here;
+        if (n == 0)
+            return true;
+        if (!stream_next_buffer(st))
+            return false;
+    }
+}
+
+
+/**
+ * Reads a 16-bit pcap field, swapping it if the file's byte order is not ours.
+*/
+static inline uint16_t get16(const unsigned char *p, bool swapped)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return swapped ? __builtin_bswap16(v) : v;
+}
+
+
+/**
+ * Reads a 32-bit pcap field, swapping it if the file's byte order is not ours.
+*/
+static inline uint32_t get32(const unsigned char *p, bool swapped)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+
+/**
+ * Splits a timestamp in nanoseconds past the second into the view's usecs and nsecs.
+*/
+static inline void set_view_nsecs(struct pkt_view *view, uint32_t ns)
+{
+    view->usecs = ns / 1000;
+    view->nsecs = ns % 1000;
+}
+
+
+/**
+ * Converts a pcapng timestamp in interface ticks into the view's time fields.
+*/
+static void set_view_ticks(struct pkt_view *view, const struct pcap_iface *iface, uint64_t ticks)
+{
+    uint64_t frac;
+
+    if (iface->ticks_per_sec != 0)
+    {
+        view->secs = ticks / iface->ticks_per_sec;
+        frac = ticks % iface->ticks_per_sec;
+        set_view_nsecs(view, (unsigned __int128) frac * 1000000000u / iface->ticks_per_sec);
+    }
+    else
+    {
+        view->secs = ticks >> iface->tick_shift;
+        frac = ticks & ((1ull << iface->tick_shift) - 1);
+        set_view_nsecs(view, ((unsigned __int128) frac * 1000000000u) >> iface->tick_shift);
+    }
+}
+
+
+/**
+ * Checks that packets of a pcap file or interface can be decoded as Ethernet frames.
+*/
+static void check_linktype(const struct pcap_iface *iface)
+{
+    char linktype[16];
+
+    if (iface->linktype != LINKTYPE_ETHERNET)
+    {
+        snprintf(linktype, sizeof(linktype), "%u", iface->linktype);
+        errexit("Unsupported pcap link type %s", linktype);
+    }
+}
+
+
+/**
+ * Handles a record that the end of the trace cuts short. Where the trace may still be
+ * being written to (partial_tail), the record is left unread and the trace ends before it;
+ * otherwise it is an error.
+*/
+static unsigned short short_record(const struct trace_reader *tr, const char *error)
+{
+    if (!tr->partial_tail)
+        errexit(error, NULL);
+    return (0);
+}
+
+
+/**
+ * Returns a view of the next record of a meta_info trace.
+*/
+static unsigned short next_meta_view(struct trace_reader *tr, struct pkt_view *view)
+{
+    struct meta_info meta;
+    const unsigned char *record;
+    size_t avail;
+
+    // 1. Meta information is copied out since records are not aligned in the file
+    record = peek_bytes(tr, META_SIZE, &avail);
+    if (avail == 0)
+        return (0);
+    if (avail < META_SIZE)
+        return short_record(tr, "cannot read meta information");
+    memcpy(&meta, record, META_SIZE);
+
+    // 2. Convert meta information to host byte order
+    view->caplen = ntohs(meta.caplen);
+    view->len = view->caplen;
+    view->secs = ntohl(meta.secs);
+    view->usecs = ntohl(meta.usecs);
+    view->nsecs = 0;
+
+    if (view->caplen > MAX_PKT_SIZE)
+        errexit("Packet too big", NULL);
+
+    // 3. Point at the packet contents
+    record = peek_bytes(tr, META_SIZE + view->caplen, &avail);
+    if (avail < META_SIZE + view->caplen)
+        return short_record(tr, "Unexpected end of file encountered");
+    view->pkt = record + META_SIZE;
+    skip_bytes(tr, META_SIZE + view->caplen);
+
+    return (1);
+}
+
+
+/**
+ * Returns a view of the next record of a classic pcap trace.
+*/
+static unsigned short next_pcap_view(struct trace_reader *tr, struct pkt_view *view)
+{
+    const unsigned char *record;
+    size_t avail;
+
+    record = peek_bytes(tr, PCAP_RECORD_SIZE, &avail);
+    if (avail == 0)
+        return (0);
+    if (avail < PCAP_RECORD_SIZE)
+        return short_record(tr, "cannot read pcap record header");
+
+    view->secs = get32(record, tr->swapped);
+    if (tr->nsec)
+    {
+        set_view_nsecs(view, get32(record + 4, tr->swapped));
+    }
+    else
+    {
+        view->usecs = get32(record + 4, tr->swapped);
+        view->nsecs = 0;
+    }
+    view->caplen = get32(record + 8, tr->swapped);
+    view->len = get32(record + 12, tr->swapped);
+    if (view->caplen > MAX_PCAP_PKT_SIZE)
+        errexit("Packet too big", NULL);
+
+    record = peek_bytes(tr, PCAP_RECORD_SIZE + view->caplen, &avail);
+    if (avail < PCAP_RECORD_SIZE + view->caplen)
+        return short_record(tr, "Unexpected end of file encountered");
+    view->pkt = record + PCAP_RECORD_SIZE;
+    skip_bytes(tr, PCAP_RECORD_SIZE + view->caplen);
+
+    return (1);
+}
+
+
+/**
+ * Starts a new pcapng section, whose byte order is given by its byte-order magic.
+*/
+static void parse_pcapng_shb(struct trace_reader *tr, const unsigned char *block)
+{
+    uint32_t magic = get32(block + 8, false);
+
+    if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+        tr->swapped = false;
+    else if (magic == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+        tr->swapped = true;
+    else
+        errexit("Invalid pcapng section header", NULL);
+    tr->num_ifaces = 0;
+}
+
+
+/**
+ * Records the link type, snaplen and timestamp resolution of a pcapng interface.
+*/
+static void parse_pcapng_idb(struct trace_reader *tr, const unsigned char *block, uint32_t block_len)
+{
+    if (tr->num_ifaces == MAX_INTERFACES)
+        errexit("Too many pcapng interfaces", NULL);
+    if (block_len < PCAPNG_IDB_SIZE)
+        errexit("Invalid pcapng interface description", NULL);
+
+    struct pcap_iface *iface = &tr->ifaces[tr->num_ifaces++];
+    iface->linktype = get16(block + 8, tr->swapped);
+    iface->snaplen = get32(block + 12, tr->swapped);
+    iface->ticks_per_sec = 1000000;
+    iface->tick_shift = 0;
+
+    // Walk the options looking for if_tsresol; everything else is ignored
+    size_t opt = PCAPNG_IDB_SIZE - 4;
+    while (opt + 4 <= block_len - 4)
+    {
+        uint16_t code = get16(block + opt, tr->swapped);
+        uint16_t len = get16(block + opt + 2, tr->swapped);
+        if (code == PCAPNG_OPT_END || opt + 4 + len > block_len - 4)
+            break;
+        if (code == PCAPNG_OPT_TSRESOL && len >= 1)
+        {
+            unsigned char resol = block[opt + 4];
+            unsigned int exp = resol & 0x7f;
+            if (resol & 0x80)
+            {
+                if (exp > 63)
+                    errexit("Unsupported pcapng timestamp resolution", NULL);
+                iface->ticks_per_sec = 0;
+                iface->tick_shift = exp;
+            }
+            else
+            {
+                if (exp > 18)
+                    errexit("Unsupported pcapng timestamp resolution", NULL);
+                iface->ticks_per_sec = 1;
+                while (exp-- > 0)
+                    iface->ticks_per_sec *= 10;
+            }
+        }
+        opt += 4 + ((len + 3) & ~3u);
+    }
+}
+
+
+/**
+ * Returns a view of the next packet of a pcapng trace, taking note of the section and
+ * interface blocks along the way and skipping every other kind of block.
+*/
+static unsigned short next_pcapng_view(struct trace_reader *tr, struct pkt_view *view)
+{
+    const unsigned char *block;
+    size_t avail;
+
+    while (true)
+    {
+        block = peek_bytes(tr, PCAPNG_SHB_SIZE, &avail);
+        if (avail == 0)
+            return (0);
+        if (avail < 8)
+            return short_record(tr, "cannot read pcapng block header");
+
+        // The section header's type reads the same in either byte order
+        uint32_t type = get32(block, tr->swapped);
+        if (type == PCAPNG_SHB)
+        {
+            if (avail < PCAPNG_SHB_SIZE)
+                return short_record(tr, "cannot read pcapng block header");
+            parse_pcapng_shb(tr, block);
+        }
+        uint32_t block_len = get32(block + 4, tr->swapped);
+        if (block_len < 12 || block_len % 4 != 0)
+            errexit("Invalid pcapng block", NULL);
+        if (type != PCAPNG_SHB && type != PCAPNG_IDB && type != PCAPNG_EPB && type != PCAPNG_SPB)
+        {
+            // Name resolution, comment, custom and other blocks can be of any size
+            if (!discard_bytes(tr, block_len))
+                return short_record(tr, "Unexpected end of file encountered");
+            continue;
+        }
+        if (block_len > MAX_PCAP_PKT_SIZE + PCAPNG_EPB_SIZE)
+            errexit("Invalid pcapng block", NULL);
+
+        block = peek_bytes(tr, block_len, &avail);
+        if (avail < block_len)
+            return short_record(tr, "Unexpected end of file encountered");
+        skip_bytes(tr, block_len);
+
+        if (type == PCAPNG_IDB)
+        {
+            parse_pcapng_idb(tr, block, block_len);
+        }
+        else if (type == PCAPNG_EPB)
+        {
+            if (block_len < PCAPNG_EPB_SIZE)
+                errexit("Invalid pcapng packet block", NULL);
+            uint32_t if_id = get32(block + 8, tr->swapped);
+            if (if_id >= tr->num_ifaces)
+                errexit("pcapng packet from undescribed interface", NULL);
+            check_linktype(&tr->ifaces[if_id]);
+
+            uint64_t ticks = ((uint64_t) get32(block + 12, tr->swapped) << 32) | get32(block + 16, tr->swapped);
+            set_view_ticks(view, &tr->ifaces[if_id], ticks);
+            view->caplen = get32(block + 20, tr->swapped);
+            view->len = get32(block + 24, tr->swapped);
+            if (view->caplen > block_len - PCAPNG_EPB_SIZE)
+                errexit("Invalid pcapng packet block", NULL);
+            view->pkt = block + PCAPNG_EPB_SIZE - 4;
+            return (1);
+        }
+        else if (type == PCAPNG_SPB)
+        {
+            // Simple packet blocks carry no timestamp and belong to the first interface
+            if (tr->num_ifaces == 0)
+                errexit("pcapng packet from undescribed interface", NULL);
+            check_linktype(&tr->ifaces[0]);
+
+            uint32_t caplen = get32(block + 8, tr->swapped);
+            if (tr->ifaces[0].snaplen != 0 && caplen > tr->ifaces[0].snaplen)
+                caplen = tr->ifaces[0].snaplen;
+            if (caplen > block_len - PCAPNG_SPB_SIZE)
+                caplen = block_len - PCAPNG_SPB_SIZE;
+            view->secs = view->usecs = view->nsecs = 0;
+            view->caplen = caplen;
+            view->len = get32(block + 8, tr->swapped);
+            view->pkt = block + PCAPNG_SPB_SIZE - 4;
+            return (1);
+        }
+    }
+}
+
+
+/**
+ * Drops the pages of the mapping that have been read from memory, so that a long scan
+ * does not keep the whole trace resident. They are read back from the file if needed.
+*/
+static void release_behind(struct trace_reader *tr)
+{
+    size_t upto = tr->off & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+
+    if (upto > tr->released)
+    {
+        madvise((void *) (tr->map + tr->released), upto - tr->released, MADV_DONTNEED);
+        STATS_SYSCALL(SYSCALL_OTHER);
+        tr->released = upto;
+    }
+    tr->release_at = tr->off + tr->release_every;
+}
+
+
+/**
+ * Makes the reader of a mapped trace release the pages it has read every so many bytes.
+*/
+void set_release_behind(struct trace_reader *tr, size_t every)
+{
+    if (tr->map == NULL)
+        return;
+    tr->release_every = every;
+    tr->release_at = tr->off + every;
+}
+
+
+/**
+ * Hands out a view of the next packet record. The view stays valid until the next call.
+
+    returns:
+    1 - a packet was read and view points at its contents
+    0 - we have hit the end of the file and no packet is available
+*/
+unsigned short next_view(struct trace_reader *tr, struct pkt_view *view)
+{
+    if (tr->off >= tr->release_at)
+        release_behind(tr);
+
+    switch (tr->format)
+    {
+        case FORMAT_PCAP:
+            return next_pcap_view(tr, view);
+        case FORMAT_PCAPNG:
+            return next_pcapng_view(tr, view);
+        default:
+            return next_meta_view(tr, view);
+    }
+}
+
+
+/**
+ * Sniffs the magic number at the start of the trace to pick its format, and consumes
+ * the classic pcap file header. Anything unrecognised is read as meta_info records;
+ * none of the magic numbers is a valid first meta_info caplen.
+*/
+static void detect_format(struct trace_reader *tr)
+{
+    const unsigned char *header;
+    size_t avail;
+
+    header = peek_bytes(tr, PCAP_HEADER_SIZE, &avail);
+    if (avail < 4)
+        return;
+
+    uint32_t magic = get32(header, false);
+    if (magic == PCAPNG_SHB)
+    {
+        tr->format = FORMAT_PCAPNG;
+        return;
+    }
+
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC)
+        tr->swapped = false;
+    else if (magic == __builtin_bswap32(PCAP_MAGIC_USEC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC))
+        tr->swapped = true;
+    else
+        return;
+
+    if (avail < PCAP_HEADER_SIZE)
+        errexit("cannot read pcap file header", NULL);
+    tr->format = FORMAT_PCAP;
+    tr->nsec = (get32(header, tr->swapped) == PCAP_MAGIC_NSEC);
+    tr->ifaces[0].snaplen = get32(header + 16, tr->swapped);
+    tr->ifaces[0].linktype = get32(header + 20, tr->swapped) & 0xffff;
+    tr->num_ifaces = 1;
+    check_linktype(&tr->ifaces[0]);
+    skip_bytes(tr, PCAP_HEADER_SIZE);
+}
+
+
+/**
+ * Sets up ring-buffered reading of a pipe, FIFO or other unmappable file, or of the
+ * mapping of a compressed trace, which the stream takes over.
+*/
+static void open_stream(struct trace_reader *tr, const unsigned char *map, size_t map_len, int notify_fd = -1)
+{
+    struct stream_state *st = new stream_state();
+
+    st->source = open_source(tr->fd, map, map_len, decompress_threads);
+    for (int k = 0; k < STREAM_BUFS; k++)
+    {
+        if ((st->bufs[k] = (unsigned char *) malloc(STREAM_PREFIX + STREAM_BUF_SIZE)) == NULL)
+            errexit("Out of memory", NULL);
+    }
+    st->notify_fd = notify_fd;
+    st->cur = STREAM_BUFS - 1;
+    st->pos = st->end = STREAM_PREFIX;
+    st->producer = std::thread(stream_fill, st);
+    tr->stream = st;
+}
+
+
+/**
+ * Sets how many threads may decompress the frames of a zstd trace (default: one per core).
+*/
+void set_decompress_threads(int threads)
+{
+    decompress_threads = threads;
+}
+
+
+/**
+ * Opens the trace file, mapping it into memory when possible. "-" reads standard input.
+ * gzip and zstd compressed traces are decompressed as they are read.
+ * Returns false if the file cannot be opened.
+*/
+bool open_trace(const char *filename, struct trace_reader *tr)
+{
+    struct stat st;
+
+    memset(tr, 0x0, sizeof(struct trace_reader));
+    tr->release_at = SIZE_MAX;
+    if (strcmp(filename, "-") == 0)
+        tr->fd = STDIN_FILENO;
+    else if ((tr->fd = open(filename, O_RDONLY)) < 0)
+        return false;
+    else
+        STATS_SYSCALL(SYSCALL_OTHER);
+
+    STATS_SYSCALL(SYSCALL_OTHER);
+    if (fstat(tr->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, tr->fd, 0);
+        STATS_SYSCALL(SYSCALL_OTHER);
+        if (map != MAP_FAILED)
+        {
+            STATS_SYSCALL(SYSCALL_OTHER);
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            if (detect_compression((const unsigned char *) map, st.st_size) != COMPRESS_NONE)
+            {
+                open_stream(tr, (const unsigned char *) map, st.st_size);
+                detect_format(tr);
+                return true;
+            }
+            tr->map = (const unsigned char *) map;
+            tr->map_len = st.st_size;
+            tr->end = st.st_size;
+            detect_format(tr);
+            return true;
+        }
+    }
+
+    open_stream(tr, NULL, 0);
+    detect_format(tr);
+    return true;
+}
+
+
+/**
+ * Opens a trace that is still being written to for reading as it grows: records are read
+ * as they are appended, and at the end of the file the reader waits on an inotify watch
+ * for more instead of stopping, until stop_following() is called.
+ * Returns false if the file cannot be opened or watched.
+*/
+bool open_trace_follow(const char *filename, struct trace_reader *tr)
+{
+    memset(tr, 0x0, sizeof(struct trace_reader));
+    tr->release_at = SIZE_MAX;
+    tr->partial_tail = true;    /* reached only once following stops, mid-write */
+    if ((tr->fd = open(filename, O_RDONLY)) < 0)
+        return false;
+    STATS_SYSCALL(SYSCALL_OTHER);
+
+    int notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd < 0 || inotify_add_watch(notify_fd, filename, IN_MODIFY) < 0)
+    {
+        if (notify_fd >= 0)
+            close(notify_fd);
+        close(tr->fd);
+        return false;
+    }
+    STATS_SYSCALL(SYSCALL_OTHER);
+    STATS_SYSCALL(SYSCALL_OTHER);
+
+    open_stream(tr, NULL, 0, notify_fd);
+    detect_format(tr);
+    return true;
+}
+
+
+/**
+ * Makes every followed trace end at the data read so far. Safe to call from a signal handler.
+*/
+void stop_following()
+{
+    follow_stopped = true;
+}
+
+
+/**
+ * Releases the mapping or stream buffers and closes the trace file.
+*/
+void close_trace(struct trace_reader *tr)
+{
+    if (tr->map != NULL)
+        munmap((void *) tr->map, tr->map_len);
+
+    if (tr->stream != NULL)
+    {
+        struct stream_state *st = tr->stream;
+        {
+            std::lock_guard<std::mutex> guard(st->lock);
+            st->stop = true;
+            st->changed.notify_all();
+        }
+        st->producer.join();
+        close_source(st->source);
+        if (st->notify_fd >= 0)
+            close(st->notify_fd);
+        for (int k = 0; k < STREAM_BUFS; k++)
+            free(st->bufs[k]);
+        delete st;
+    }
+    close(tr->fd);
+}
+
+
+/**
+ * Returns the length of the record or block at off in a mapped trace, or 0 if it runs
+ * past the end. pcapng section and interface blocks are parsed on the way so that the
+ * chunks after them know the interfaces; a second section makes the trace unsplittable.
+*/
+static size_t record_length(struct trace_reader *tr, size_t off, bool *splittable)
+{
+    const unsigned char *record = tr->map + off;
+    size_t left = tr->end - off;
+    size_t len;
+
+    switch (tr->format)
+    {
+        case FORMAT_PCAP:
+            if (left < PCAP_RECORD_SIZE)
+                return 0;
+            len = PCAP_RECORD_SIZE + get32(record + 8, tr->swapped);
+            break;
+        case FORMAT_PCAPNG:
+            if (left < 8)
+                return 0;
+            if (get32(record, tr->swapped) == PCAPNG_SHB)
+            {
+                if (off != 0)
+                    *splittable = false;
+                if (left < PCAPNG_SHB_SIZE)
+                    return 0;
+                parse_pcapng_shb(tr, record);
+            }
+            len = get32(record + 4, tr->swapped);
+            if (len < 12 || len > left)
+                return 0;
+            if (get32(record, tr->swapped) == PCAPNG_IDB)
+                parse_pcapng_idb(tr, record, len);
+            break;
+        default:
+            if (left < META_SIZE)
+                return 0;
+            len = META_SIZE + ntohs(get16(record, false));
+            break;
+    }
+    return len <= left ? len : 0;
+}
+
+
+/**
+ * Splits a mapped trace into at most max_chunks readers over byte ranges of roughly
+ * equal size that start and end on record boundaries, found by hopping from record to
+ * record by their lengths. Each chunk shares tr's mapping and must not be closed.
+ * Returns the number of chunks.
+*/
+int split_trace(struct trace_reader *tr, int max_chunks, struct trace_reader *chunks)
+{
+    struct trace_reader walk = *tr;
+    size_t total = tr->end - tr->off;
+    size_t off = tr->off;
+    bool splittable = true;
+    int num_chunks = 0;
+
+    chunks[0] = *tr;
+    for (int i = 1; i < max_chunks && splittable; i++)
+    {
+        size_t target = tr->off + total / max_chunks * i;
+
+        // A truncated record is left for the worker that reads it to report
+        while (off < target && splittable)
+        {
+            size_t len = record_length(&walk, off, &splittable);
+            if (len == 0)
+                break;
+            off += len;
+        }
+        if (!splittable)
+            break;
+        if (off >= tr->end || off < target)
+            break;
+        if (off > chunks[num_chunks].off)
+        {
+            // The new chunk knows the interfaces described before it
+            chunks[num_chunks].end = off;
+            chunks[++num_chunks] = walk;
+            chunks[num_chunks].off = off;
+        }
+    }
+
+    if (!splittable)
+    {
+        chunks[0] = *tr;
+        return 1;
+    }
+    chunks[num_chunks].end = tr->end;
+    return num_chunks + 1;
+}
+
+
+/**
+ * Positions a mapped trace at off, which must be the start of a record (or of a block
+ * at the top level of a pcapng file). pcapng sections and interfaces described before
+ * off are picked up by hopping over the blocks from the start of the file.
+*/
+void seek_trace(struct trace_reader *tr, size_t off)
+{
+    if (tr->format == FORMAT_PCAPNG)
+    {
+        bool splittable = true;
+        size_t at = 0;
+        tr->num_ifaces = 0;
+        while (at < off)
+        {
+            size_t len = record_length(tr, at, &splittable);
+            if (len == 0)
+                break;
+            at += len;
+        }
+    }
+    tr->off = off;
+}
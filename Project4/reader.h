@@ -0,0 +1,66 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "next.h"
+
+#define MAX_INTERFACES 64           /* pcapng interfaces per section */
+
+#define LINKTYPE_ETHERNET 1
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_SIZE 16
+
+struct stream_state;
+
+/* trace file formats, told apart by the magic number at the start of the file */
+enum trace_format
+{
+    FORMAT_META,                /* the course's meta_info records */
+    FORMAT_PCAP,                /* classic pcap, either byte order, usec or nsec */
+    FORMAT_PCAPNG
+};
+
+/* link type and timestamp resolution of a pcap file or pcapng interface */
+struct pcap_iface
+{
+    unsigned int linktype;
+    unsigned int snaplen;
+    uint64_t ticks_per_sec;     /* for decimal resolutions, 0 if binary */
+    unsigned int tick_shift;    /* for binary resolutions: ticks are 2^-tick_shift s */
+};
+
+/* a trace file opened for reading, either memory-mapped or streamed through buffers */
+struct trace_reader
+{
+    int fd;
+    const unsigned char *map;   /* whole file mapping, NULL if not mapped */
+    size_t map_len;
+    size_t off;                 /* offset of the next record in the mapping */
+    size_t end;                 /* offset to stop reading at */
+    struct stream_state *stream;    /* buffers of an unmappable trace, NULL if mapped */
+    size_t release_every;       /* with set_release_behind(): bytes read between releases */
+    size_t release_at;          /* offset of the next release, SIZE_MAX if never */
+    size_t released;            /* the mapping is released up to this offset */
+    bool partial_tail;          /* a record cut short by the end of the trace ends it cleanly */
+
+    enum trace_format format;
+    bool swapped;               /* pcap fields are in the opposite byte order to ours */
+    bool nsec;                  /* classic pcap with nanosecond timestamps */
+    unsigned int num_ifaces;    /* pcapng interfaces seen so far in this section */
+    struct pcap_iface ifaces[MAX_INTERFACES];   /* ifaces[0] describes a classic pcap */
+};
+
+bool open_trace(const char *filename, struct trace_reader *tr);
+bool open_trace_follow(const char *filename, struct trace_reader *tr);
+void stop_following();
+void close_trace(struct trace_reader *tr);
+unsigned short next_view(struct trace_reader *tr, struct pkt_view *view);
+int split_trace(struct trace_reader *tr, int max_chunks, struct trace_reader *chunks);
+void seek_trace(struct trace_reader *tr, size_t off);
+void set_release_behind(struct trace_reader *tr, size_t every);
+void set_decompress_threads(int threads);
+
+#endif
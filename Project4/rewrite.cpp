@@ -0,0 +1,218 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: rewrite.cpp
+ *
+ * Filtered trace rewriting (-O). Records of a mapped meta_info or native byte order pcap
+ * trace are written out as they are, straight from the mapping; a run of matching records
+ * becomes a single iovec, so carving a subset out of a trace costs little more than the
+ * write itself. Other inputs get a pcap record header made up for each packet.
+ * */
+
+
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "rewrite.h"
+#include "stats.h"
+
+
+/**
+ * Writes everything gathered so far with as few writev() calls as it takes, then forgets
+ * the iovecs and the headers and copies they pointed to.
+*/
+static void rw_flush(struct trace_rewriter *w)
+{
+    struct iovec *iov = w->iov.data();
+    int left = w->iov.size();
+
+    while (left > 0)
+    {
+        ssize_t n = writev(w->fd, iov, left < IOV_MAX ? left : IOV_MAX);
+        STATS_SYSCALL(SYSCALL_WRITE);
+        if (n < 0)
+            errexit("cannot write rewritten trace", NULL);
+
+        // Skip what was written, which may end partway through an iovec
+        while (left > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            left--;
+        }
+        if (left > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    w->iov.clear();
+    w->pending = 0;
+    w->headers.clear();
+    w->copies.clear();
+}
+
+
+/**
+ * Adds len bytes at data to the output, merging them into the last iovec if they follow
+ * straight on from it. data must stay valid until the writer flushes.
+*/
+static void rw_add(struct trace_rewriter *w, const void *data, size_t len)
+{
+    if (!w->iov.empty() && (const char *) w->iov.back().iov_base + w->iov.back().iov_len == data)
+        w->iov.back().iov_len += len;
+    else
+    {
+        struct iovec v = { (void *) data, len };
+        w->iov.push_back(v);
+    }
+
+    w->pending += len;
+    if (w->fd >= 0 && (w->iov.size() >= IOV_MAX || w->pending >= RW_FLUSH_BYTES))
+        rw_flush(w);
+}
+
+
+/**
+ * Adds len bytes that will not outlive the current record to the output, by way of a copy.
+*/
+static void rw_add_copy(struct trace_rewriter *w, const void *data, size_t len)
+{
+    if (w->copies.empty() || w->copies.back().capacity() - w->copies.back().size() < len)
+    {
+        w->copies.push_back(std::vector<unsigned char>());
+        w->copies.back().reserve(len > RW_COPY_BLOCK ? len : RW_COPY_BLOCK);
+    }
+
+    // The block never reallocates, so earlier iovecs into it stay valid
+    std::vector<unsigned char> &block = w->copies.back();
+    size_t at = block.size();
+    block.insert(block.end(), (const unsigned char *) data, (const unsigned char *) data + len);
+    rw_add(w, &block[at], len);
+}
+
+
+/**
+ * Opens the rewritten trace. It is a pcap file if pcap is set, else meta_info records,
+ * which only a meta_info input can give. A pcap file has nanosecond timestamps if the
+ * input has (pcap) or may have (pcapng) them.
+*/
+void rw_open(struct trace_rewriter *w, const char *filename, bool pcap, const struct trace_reader *tr)
+{
+    if (!pcap && tr->format != FORMAT_META)
+        errexit("Only a meta_info trace can be rewritten as meta_info, use -O pcap:%s", filename);
+
+    w->pcap = pcap;
+    w->nsec = tr->format == FORMAT_PCAP ? tr->nsec : tr->format == FORMAT_PCAPNG;
+    w->in_format = tr->format;
+    w->in_swapped = tr->swapped;
+    w->zero_copy = tr->map != NULL;
+    w->pending = 0;
+    if ((w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        errexit("cannot open rewritten trace %s", filename);
+    STATS_SYSCALL(SYSCALL_OTHER);
+
+    if (pcap)
+    {
+        unsigned char header[PCAP_HEADER_SIZE];
+        uint32_t magic = w->nsec ? PCAP_MAGIC_NSEC : PCAP_MAGIC_USEC;
+        uint16_t version[2] = { 2, 4 };
+        uint32_t zone_sigfigs[2] = { 0, 0 };
+        uint32_t snaplen = tr->format == FORMAT_PCAP ? tr->ifaces[0].snaplen : MAX_PCAP_PKT_SIZE;
+        uint32_t linktype = LINKTYPE_ETHERNET;
+
+        memcpy(header, &magic, 4);
+        memcpy(header + 4, version, 4);
+        memcpy(header + 8, zone_sigfigs, 8);
+        memcpy(header + 16, &snaplen, 4);
+        memcpy(header + 20, &linktype, 4);
+        rw_add_copy(w, header, sizeof(header));
+    }
+}
+
+
+/**
+ * Sets up an in-memory writer for one chunk of the trace, writing like parent.
+*/
+void rw_open_chunk(struct trace_rewriter *w, const struct trace_rewriter *parent)
+{
+    w->fd = -1;
+    w->pcap = parent->pcap;
+    w->nsec = parent->nsec;
+    w->in_format = parent->in_format;
+    w->in_swapped = parent->in_swapped;
+    w->zero_copy = parent->zero_copy;
+    w->pending = 0;
+}
+
+
+/**
+ * Handles -O by adding the packet to the rewritten trace: its whole record as it is when
+ * the output format is the input's, else a made up pcap record header and the packet.
+*/
+void rw_packet(struct trace_rewriter *w, const struct pkt_info &pinfo)
+{
+    auto add = w->zero_copy ? rw_add : rw_add_copy;
+
+    if (!w->pcap)
+    {
+        add(w, pinfo.pkt - sizeof(struct meta_info), sizeof(struct meta_info) + pinfo.caplen);
+        return;
+    }
+    if (w->in_format == FORMAT_PCAP && !w->in_swapped)
+    {
+        add(w, pinfo.pkt - PCAP_RECORD_SIZE, PCAP_RECORD_SIZE + pinfo.caplen);
+        return;
+    }
+
+    struct pcap_record hdr;
+    if (w->in_format == FORMAT_PCAP)
+    {
+        // The input's own header, in our byte order
+        memcpy(&hdr, pinfo.pkt - PCAP_RECORD_SIZE, sizeof(hdr));
+        hdr.secs = __builtin_bswap32(hdr.secs);
+        hdr.frac = __builtin_bswap32(hdr.frac);
+        hdr.caplen = __builtin_bswap32(hdr.caplen);
+        hdr.len = __builtin_bswap32(hdr.len);
+    }
+    else
+    {
+        hdr.secs = pinfo.secs;
+        hdr.frac = w->nsec ? pinfo.nsecs : pinfo.usecs;
+        hdr.caplen = pinfo.caplen;
+        hdr.len = pinfo.len;
+    }
+    w->headers.push_back(hdr);
+    rw_add(w, &w->headers.back(), sizeof(hdr));
+    add(w, pinfo.pkt, pinfo.caplen);
+}
+
+
+/**
+ * Appends the output of a later chunk, which is then emptied. Its iovecs only point into
+ * the mapping or into the chunk, so they are written before the chunk lets go of them.
+*/
+void rw_append_writer(struct trace_rewriter *w, struct trace_rewriter *later)
+{
+    for (const auto &v: later->iov)
+        rw_add(w, v.iov_base, v.iov_len);
+    rw_flush(w);
+
+    later->iov.clear();
+    later->pending = 0;
+    later->headers.clear();
+    later->copies.clear();
+}
+
+
+/**
+ * Writes whatever is left and closes the rewritten trace.
+*/
+void rw_close(struct trace_rewriter *w)
+{
+    rw_flush(w);
+    if (close(w->fd) != 0)
+        errexit("cannot write rewritten trace", NULL);
+}
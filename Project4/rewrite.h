@@ -0,0 +1,51 @@
+#ifndef REWRITE_H
+#define REWRITE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <deque>
+#include <vector>
+#include "reader.h"
+
+#define RW_FLUSH_BYTES (4 << 20)    /* bytes gathered before a writev() */
+#define RW_COPY_BLOCK (1 << 20)     /* records of an unmapped trace are copied in blocks this big */
+
+/* layout of a classic pcap record header, as written */
+struct pcap_record
+{
+    uint32_t secs;
+    uint32_t frac;                  /* microseconds, or nanoseconds in an nsec file */
+    uint32_t caplen;
+    uint32_t len;
+};
+
+/**
+ * Writer of the packets that pass -f and -T back out as a trace, for -O. Records are not
+ * copied: the writer gathers iovecs pointing straight into the mapping of the input
+ * (merging adjacent records into one) and writes them with writev(). Only record headers
+ * it has to make up, and records of a streamed trace, are stored in the writer itself.
+ * With fd < 0 the iovecs are just kept (used for per-chunk output, which is appended
+ * while the trace is still mapped).
+*/
+struct trace_rewriter
+{
+    int fd;
+    bool pcap;                      /* write pcap, else meta_info records */
+    bool nsec;                      /* pcap with nanosecond timestamps */
+    enum trace_format in_format;
+    bool in_swapped;
+    bool zero_copy;                 /* the input is mapped for the whole run */
+    std::vector<struct iovec> iov;
+    size_t pending;                 /* bytes the iovecs cover */
+    std::deque<struct pcap_record> headers;     /* made up headers the iovecs point to */
+    std::deque<std::vector<unsigned char> > copies;     /* copied records, in blocks */
+};
+
+void rw_open(struct trace_rewriter *w, const char *filename, bool pcap, const struct trace_reader *tr);
+void rw_open_chunk(struct trace_rewriter *w, const struct trace_rewriter *parent);
+void rw_packet(struct trace_rewriter *w, const struct pkt_info &pinfo);
+void rw_append_writer(struct trace_rewriter *w, struct trace_rewriter *later);
+void rw_close(struct trace_rewriter *w);
+
+#endif
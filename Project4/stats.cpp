@@ -0,0 +1,147 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: stats.cpp
+ *
+ * Hot path instrumentation behind -S, only built into proj4_stats. Each thread charges
+ * the cycles between stage switches to the stage it was in and counts packets and hash
+ * table work in thread-local counters; they are added up when the thread is done. In the
+ * scan loop only sampled packets are timed (see stats_packet()). The cycle counts are
+ * turned into seconds with the rate measured over the whole run.
+ * */
+
+#ifdef PROJ4_STATS
+
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include "stats.h"
+
+thread_local struct thread_stats stats;
+uint64_t stats_clock_cost;          /* cycles between two back-to-back clock reads */
+
+static const char *const STAGE_NAMES[NUM_STAGES] = { "other", "read", "decode", "filter", "aggregate", "format" };
+
+static std::mutex totals_lock;
+static struct thread_stats totals;
+static std::atomic<uint64_t> syscalls[NUM_SYSCALLS];
+static std::atomic<uint64_t> bytes_read;
+static uint64_t start_cycles;
+static double start_secs;
+
+
+static double wall_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Measures what reading the clock costs, so that it is not charged to the stages, and
+ * starts the clock of the whole run on the main thread.
+*/
+void stats_start()
+{
+    stats_clock_cost = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t before = stats_clock();
+        uint64_t spent = stats_clock() - before;
+        if (spent < stats_clock_cost)
+            stats_clock_cost = spent;
+    }
+    start_secs = wall_secs();
+    start_cycles = stats_clock();
+    stats_thread_start();
+}
+
+
+/**
+ * Starts charging the calling thread's cycles, to STAGE_OTHER until its first switch.
+*/
+void stats_thread_start()
+{
+    stats.stage = STAGE_OTHER;
+    stats.last = stats_clock();
+    stats.timing = true;
+    stats.weight = 1;
+}
+
+
+/**
+ * Adds the calling thread's counters to the process totals and clears them.
+*/
+void stats_thread_done()
+{
+    stats_switch(STAGE_OTHER);
+
+    std::lock_guard<std::mutex> guard(totals_lock);
+    for (int i = 0; i < NUM_STAGES; i++)
+        totals.cycles[i] += stats.cycles[i];
+    totals.packets += stats.packets;
+    totals.hash_lookups += stats.hash_lookups;
+    totals.hash_probes += stats.hash_probes;
+    totals.hash_resizes += stats.hash_resizes;
+
+    uint64_t last = stats.last;
+    stats = thread_stats();
+    stats.last = last;
+    stats.timing = true;
+    stats.weight = 1;
+}
+
+
+void stats_syscall(int kind)
+{
+    syscalls[kind].fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void stats_bytes_read(uint64_t bytes)
+{
+    bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+
+/**
+ * Prints the time of each stage, the packet rate, the bytes read and the system calls
+ * and hash table work counted, once the main thread is done. With several threads, the
+ * stage times add up the time of all of them.
+*/
+void print_stats(FILE *out)
+{
+    stats_thread_done();
+
+    double secs = wall_secs() - start_secs;
+    double cycles_per_sec = secs > 0 ? (stats_clock() - start_cycles) / secs : 1;
+    uint64_t pkts = totals.packets;
+    uint64_t all_cycles = 0;
+
+    for (int i = 0; i < NUM_STAGES; i++)
+        all_cycles += totals.cycles[i];
+
+    fprintf(out, "%-10s %10s %7s %10s\n", "STAGE", "SECONDS", "SHARE", "NS/PKT");
+    for (int i = 1; i <= NUM_STAGES; i++)
+    {
+        int stage = i % NUM_STAGES;     // other last
+        double stage_secs = totals.cycles[stage] / cycles_per_sec;
+        fprintf(out, "%-10s %10.6f %6.1f%% %10.1f\n", STAGE_NAMES[stage], stage_secs,
+                all_cycles > 0 ? 100.0 * totals.cycles[stage] / all_cycles : 0.0,
+                pkts > 0 ? stage_secs * 1e9 / pkts : 0.0);
+    }
+    fprintf(out, "WALL TIME: %f s\n", secs);
+    fprintf(out, "PACKETS: %llu (%.0f pkts/s)\n", (unsigned long long) pkts, secs > 0 ? pkts / secs : 0.0);
+    fprintf(out, "BYTES READ: %llu (%.1f MB/s)\n", (unsigned long long) bytes_read.load(),
+            secs > 0 ? bytes_read.load() / secs / 1e6 : 0.0);
+    fprintf(out, "SYSCALLS: %llu read, %llu write, %llu other (trace and -l/-p/-x output; not stdio)\n",
+            (unsigned long long) syscalls[SYSCALL_READ].load(), (unsigned long long) syscalls[SYSCALL_WRITE].load(),
+            (unsigned long long) syscalls[SYSCALL_OTHER].load());
+    fprintf(out, "HASH TABLES: %llu lookups, %llu probes (%.2f per lookup), %llu resizes\n",
+            (unsigned long long) totals.hash_lookups, (unsigned long long) totals.hash_probes,
+            totals.hash_lookups > 0 ? (double) totals.hash_probes / totals.hash_lookups : 0.0,
+            (unsigned long long) totals.hash_resizes);
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* stages of the hot path that -S times; time outside them (setup, waiting) is STAGE_OTHER */
+enum stats_stage
+{
+    STAGE_OTHER,
+    STAGE_READ,                 /* getting the next record from the trace */
+    STAGE_DECODE,               /* meta information and locating headers */
+    STAGE_FILTER,               /* time range and -f */
+    STAGE_AGGREGATE,            /* the modes that keep totals */
+    STAGE_FORMAT,               /* the modes that print per packet, and the final reports */
+    NUM_STAGES
+};
+
+/* system calls counted by kind */
+enum stats_syscall
+{
+    SYSCALL_READ,
+    SYSCALL_WRITE,
+    SYSCALL_OTHER,
+    NUM_SYSCALLS
+};
+
+/*
+ * The instrumentation only exists in builds with PROJ4_STATS defined (make proj4_stats).
+ * Everywhere else the STATS_* macros expand to nothing, so the hot path of proj4 itself
+ * carries no trace of it.
+ */
+#ifdef PROJ4_STATS
+
+#define STATS_SAMPLE_EVERY 32       /* the scan loop times one packet in this many */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/* counters of one thread, folded into the process totals when the thread is done */
+struct thread_stats
+{
+    uint64_t cycles[NUM_STAGES];
+    uint64_t packets;
+    uint64_t hash_lookups;      /* traffic matrix and heavy hitter table lookups */
+    uint64_t hash_probes;       /* slots looked at by those lookups */
+    uint64_t hash_resizes;
+    int stage;                  /* stage the cycles since last belong to */
+    uint64_t last;
+    uint64_t reads;             /* packets the scan loop has started on */
+    bool timing;                /* false between samples in the scan loop */
+    unsigned int weight;        /* packets each timed cycle stands for */
+};
+
+extern thread_local struct thread_stats stats;
+extern uint64_t stats_clock_cost;
+
+
+/**
+ * Returns a cycle counter: the TSC where there is one, nanoseconds elsewhere.
+*/
+static inline uint64_t stats_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+
+/**
+ * Charges the cycles since the last switch to the current stage and moves on to stage.
+ * Returns the stage that was current, to switch back to.
+*/
+static inline int stats_switch(int stage)
+{
+    int prev = stats.stage;
+
+    stats.stage = stage;
+    if (stats.timing)
+    {
+        uint64_t now = stats_clock();
+        uint64_t spent = now - stats.last;
+        stats.cycles[prev] += (spent > stats_clock_cost ? spent - stats_clock_cost : 0) * stats.weight;
+        stats.last = now;
+    }
+    return prev;
+}
+
+
+/**
+ * Starts the next packet of the scan loop in STAGE_READ. Only one packet in
+ * STATS_SAMPLE_EVERY is timed, standing for the ones in between, which keeps reading
+ * the clock off the path of most packets.
+*/
+static inline void stats_packet()
+{
+    bool sample = stats.reads++ % STATS_SAMPLE_EVERY == 0;
+
+    stats_switch(STAGE_READ);
+    if (sample && !stats.timing)
+        stats.last = stats_clock();
+    stats.timing = sample;
+}
+
+
+/**
+ * Switches the scan loop's packet sampling on (entering the loop) or off (leaving it).
+*/
+static inline void stats_loop(bool in_loop)
+{
+    stats_switch(STAGE_OTHER);
+    if (!stats.timing)
+        stats.last = stats_clock();
+    stats.timing = true;
+    stats.weight = in_loop ? STATS_SAMPLE_EVERY : 1;
+}
+
+/* switches to a stage for the rest of the enclosing scope, then back */
+struct stats_scope
+{
+    explicit stats_scope(int stage) : prev(stats_switch(stage)) {}
+    ~stats_scope() { stats_switch(prev); }
+    int prev;
+};
+
+void stats_start();
+void stats_thread_start();
+void stats_thread_done();
+void stats_syscall(int kind);
+void stats_bytes_read(uint64_t bytes);
+void print_stats(FILE *out);
+
+#define STATS_STAGE(stage)          stats_switch(stage)
+#define STATS_SCOPE(stage)          struct stats_scope stats_scope_guard(stage)
+#define STATS_PACKET()              stats_packet()
+#define STATS_LOOP_BEGIN()          stats_loop(true)
+#define STATS_LOOP_END()            stats_loop(false)
+#define STATS_COUNT(field, n)       (stats.field += (n))
+#define STATS_SYSCALL(kind)         stats_syscall(kind)
+#define STATS_BYTES_READ(n)         stats_bytes_read(n)
+#define STATS_START()               stats_start()
+#define STATS_THREAD_START()        stats_thread_start()
+#define STATS_THREAD_DONE()         stats_thread_done()
+
+#else
+
+#define STATS_STAGE(stage)          ((void) 0)
+#define STATS_SCOPE(stage)          ((void) 0)
+#define STATS_PACKET()              ((void) 0)
+#define STATS_LOOP_BEGIN()          ((void) 0)
+#define STATS_LOOP_END()            ((void) 0)
+#define STATS_COUNT(field, n)       ((void) 0)
+#define STATS_SYSCALL(kind)         ((void) 0)
+#define STATS_BYTES_READ(n)         ((void) 0)
+#define STATS_START()               ((void) 0)
+#define STATS_THREAD_START()        ((void) 0)
+#define STATS_THREAD_DONE()         ((void) 0)
+
+#endif
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: throughput.cpp
+ *
+ * Fixed-width time bucket counters for throughput mode. The arrays only ever cover the
+ * buckets between the earliest and latest packet seen, padding gaps with zeros.
+ * */
+
+
+#include <math.h>
+#include "next.h"
+#include "throughput.h"
+
+
+/**
+ * Sets up an empty series of buckets width seconds wide.
+*/
+void ThroughputSeries::init(double bucket_width)
+{
+    width = bucket_width;
+    first = 0;
+    for (auto *column: { &pkts, &ip_pkts, &ip_bytes, &tcp_pkts, &udp_pkts, &payload_bytes })
+    {
+        column->clear();
+        column->reserve(TP_INITIAL_BUCKETS);
+    }
+}
+
+
+/**
+ * Returns the array index of a bucket, extending the arrays to reach it.
+*/
+size_t ThroughputSeries::slot(long long bucket)
+{
+    if (pkts.empty())
+        first = bucket;
+
+    if (bucket < first)
+    {
+        // Out of order timestamps: add zeroed buckets in front
+        size_t extra = first - bucket;
+        if (pkts.size() + extra > TP_MAX_BUCKETS)
+            errexit("Too many time buckets, use a larger bucket width", NULL);
+        for (auto *column: { &pkts, &ip_pkts, &ip_bytes, &tcp_pkts, &udp_pkts, &payload_bytes })
+            column->insert(column->begin(), extra, 0);
+        first = bucket;
+    }
+
+    size_t i = bucket - first;
+    if (i >= pkts.size())
+    {
+        if (i >= TP_MAX_BUCKETS)
+            errexit("Too many time buckets, use a larger bucket width", NULL);
+        for (auto *column: { &pkts, &ip_pkts, &ip_bytes, &tcp_pkts, &udp_pkts, &payload_bytes })
+            column->resize(i + 1, 0);
+    }
+    return i;
+}
+
+
+/**
+ * Counts one packet with timestamp now.
+*/
+void ThroughputSeries::add(double now, const struct tp_sample &sample)
+{
+    size_t i = slot((long long) floor(now / width));
+
+    pkts[i]++;
+    ip_pkts[i] += sample.ip;
+    ip_bytes[i] += sample.ip_bytes;
+    tcp_pkts[i] += sample.tcp;
+    udp_pkts[i] += sample.udp;
+    payload_bytes[i] += sample.payload_bytes;
+}
+
+
+/**
+ * Adds the buckets of a series over another part of the trace, with the same width.
+*/
+void ThroughputSeries::merge(const ThroughputSeries &other)
+{
+    if (other.pkts.empty())
+        return;
+
+    // Reach both ends first so that the loop below never moves the arrays
+    slot(other.first);
+    slot(other.first + other.pkts.size() - 1);
+    size_t base = other.first - first;
+    for (size_t i = 0; i < other.pkts.size(); i++)
+    {
+        pkts[base + i] += other.pkts[i];
+        ip_pkts[base + i] += other.ip_pkts[i];
+        ip_bytes[base + i] += other.ip_bytes[i];
+        tcp_pkts[base + i] += other.tcp_pkts[i];
+        udp_pkts[base + i] += other.udp_pkts[i];
+        payload_bytes[base + i] += other.payload_bytes[i];
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef THROUGHPUT_H
+#define THROUGHPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define TP_INITIAL_BUCKETS 4096     /* buckets allocated up front */
+#define TP_MAX_BUCKETS (1 << 24)    /* refuse widths that would need more than this */
+
+/* what one packet adds to its bucket */
+struct tp_sample
+{
+    int ip;                         /* 1 if the packet is IP, else 0; likewise tcp and udp */
+    int tcp;
+    int udp;
+    int ip_bytes;                   /* IP total length */
+    int payload_bytes;              /* TCP or UDP payload length */
+};
+
+/**
+ * Per-interval packet and byte counts over fixed-width time buckets. Bucket i covers
+ * [i * width, (i + 1) * width), so series of different parts of a trace line up and merge
+ * bucket by bucket. Each counter lives in its own array indexed by bucket.
+*/
+class ThroughputSeries
+{
+public:
+    ThroughputSeries() : width(0), first(0) {}
+
+    void init(double width);
+    bool enabled() const { return width > 0; }
+    void add(double now, const struct tp_sample &sample);
+    void merge(const ThroughputSeries &other);
+    size_t size() const { return pkts.size(); }
+    double bucket_start(size_t i) const { return (first + (long long) i) * width; }
+
+    // Counters of bucket first + i
+    std::vector<long long> pkts;
+    std::vector<long long> ip_pkts;
+    std::vector<long long> ip_bytes;
+    std::vector<long long> tcp_pkts;
+    std::vector<long long> udp_pkts;
+    std::vector<long long> payload_bytes;
+
+private:
+    size_t slot(long long bucket);
+
+    double width;
+    long long first;                /* bucket number of the first array element */
+};
+
+#endif
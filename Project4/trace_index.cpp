@@ -0,0 +1,213 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: trace_index.cpp
+ *
+ * Sparse timestamp index of a trace file. Every stride packets the index records the
+ * offset of the block and the earliest and latest timestamp in it, so that a time range
+ * query only reads the blocks that can hold matching packets. The index lives next to
+ * the trace in trace_file.idx, and later runs only index what was appended since.
+ * */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string>
+#include <algorithm>
+#include "trace_index.h"
+
+#define INDEX_MAGIC "P4INDEX1"
+#define HEAD_HASH_BYTES 4096        /* trace bytes hashed to notice a replaced trace */
+
+/* layout of the start of the sidecar file; the entries follow it */
+struct index_header
+{
+    char magic[8];
+    uint32_t stride;
+    uint32_t last_count;
+    uint32_t format;
+    uint32_t reserved;
+    uint64_t trace_ino;
+    uint64_t trace_head;            /* FNV-1a hash of the first bytes of the trace */
+    uint64_t indexed_bytes;
+    uint64_t num_entries;
+};
+
+
+/**
+ * Hashes the first bytes of the trace, which change if the file is replaced.
+*/
+static uint64_t hash_head(const struct trace_reader *tr)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t n = std::min((size_t) HEAD_HASH_BYTES, tr->map_len);
+
+    for (size_t i = 0; i < n; i++)
+        hash = (hash ^ tr->map[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+
+/**
+ * Loads the sidecar index if it exists, is intact and still describes this trace.
+ * Returns false (leaving idx empty) if it has to be built from scratch.
+*/
+static bool load_index(int fd, const struct index_header &expect, struct trace_index *idx,
+                       size_t trace_len)
+{
+    struct index_header hdr;
+    struct stat st;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) || fstat(fd, &st) != 0)
+        return false;
+    if (memcmp(hdr.magic, expect.magic, sizeof(hdr.magic)) != 0 || hdr.stride == 0
+        || (expect.stride != 0 && hdr.stride != expect.stride) || hdr.format != expect.format
+        || hdr.trace_ino != expect.trace_ino || hdr.trace_head != expect.trace_head
+        || hdr.indexed_bytes > trace_len || hdr.last_count > hdr.stride
+        || hdr.num_entries != (st.st_size - sizeof(hdr)) / sizeof(struct index_entry)
+        || (uint64_t) st.st_size != sizeof(hdr) + hdr.num_entries * sizeof(struct index_entry))
+        return false;
+
+    idx->entries.resize(hdr.num_entries);
+    size_t len = hdr.num_entries * sizeof(struct index_entry);
+    if (len > 0 && pread(fd, &idx->entries[0], len, sizeof(hdr)) != (ssize_t) len)
+    {
+        idx->entries.clear();
+        return false;
+    }
+    // Block offsets must rise within the indexed part of the trace
+    for (size_t i = 0; i < idx->entries.size(); i++)
+    {
+        if (idx->entries[i].offset >= hdr.indexed_bytes
+            || (i > 0 && idx->entries[i].offset <= idx->entries[i - 1].offset))
+        {
+            idx->entries.clear();
+            return false;
+        }
+    }
+    idx->stride = hdr.stride;
+    idx->last_count = hdr.last_count;
+    idx->indexed_bytes = hdr.indexed_bytes;
+    return true;
+}
+
+
+/**
+ * Brings the index of a mapped trace up to date, reusing and extending the sidecar file
+ * from earlier runs. Only the packets past the indexed part of the trace are read.
+ * A stride of 0 reuses whatever stride an existing index has, or INDEX_STRIDE.
+*/
+void update_index(const char *trace_filename, struct trace_reader *tr, unsigned int stride,
+                  struct trace_index *idx)
+{
+    struct index_header hdr;
+    struct stat st;
+    struct pkt_view view;
+    std::string path = std::string(trace_filename) + INDEX_SUFFIX;
+
+    if (tr->map == NULL)
+        errexit("The index needs an uncompressed regular trace file, not %s", trace_filename);
+
+    memset(&hdr, 0x0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.stride = stride;
+    hdr.format = tr->format;
+    hdr.trace_ino = fstat(tr->fd, &st) == 0 ? st.st_ino : 0;
+    hdr.trace_head = hash_head(tr);
+
+    idx->entries.clear();
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || !load_index(fd, hdr, idx, tr->map_len))
+    {
+        idx->stride = stride != 0 ? stride : INDEX_STRIDE;
+        idx->last_count = 0;
+        idx->indexed_bytes = tr->off;
+    }
+    stride = hdr.stride = idx->stride;
+
+    // The last block may be partial, so it is rewritten along with any new ones
+    size_t first_dirty = idx->entries.size();
+    if (first_dirty > 0 && idx->last_count < stride)
+        first_dirty--;
+    uint64_t old_indexed = idx->indexed_bytes;
+
+    // A last record that is still being written is left for a later run to index
+    struct trace_reader walk = *tr;
+    walk.end = tr->map_len;
+    walk.partial_tail = true;
+    seek_trace(&walk, idx->indexed_bytes);
+    while (true)
+    {
+        size_t off = walk.off;
+        if (!next_view(&walk, &view))
+            break;
+
+        double now = packet_time(&view);
+        if (idx->entries.empty() || idx->last_count == stride)
+        {
+            struct index_entry entry = { off, now, now };
+            idx->entries.push_back(entry);
+            idx->last_count = 0;
+        }
+        struct index_entry &entry = idx->entries.back();
+        entry.min_now = std::min(entry.min_now, now);
+        entry.max_now = std::max(entry.max_now, now);
+        idx->last_count++;
+    }
+    idx->indexed_bytes = walk.off;
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "WARNING: cannot write index file %s\n", path.c_str());
+        return;
+    }
+    if (idx->indexed_bytes != old_indexed || idx->entries.empty())
+    {
+        hdr.last_count = idx->last_count;
+        hdr.indexed_bytes = idx->indexed_bytes;
+        hdr.num_entries = idx->entries.size();
+        size_t len = (idx->entries.size() - first_dirty) * sizeof(struct index_entry);
+        off_t at = sizeof(hdr) + first_dirty * sizeof(struct index_entry);
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)
+            || (len > 0 && pwrite(fd, &idx->entries[first_dirty], len, at) != (ssize_t) len)
+            || ftruncate(fd, at + len) != 0)
+            fprintf(stderr, "WARNING: cannot write index file %s\n", path.c_str());
+    }
+    close(fd);
+}
+
+
+/**
+ * Finds the byte range [begin_off, end_off) of the blocks that can hold packets with
+ * start <= now <= end. Timestamps need not be sorted: blocks are searched by the running
+ * maximum of their latest times from the front and the running minimum of their earliest
+ * times from the back, both of which are sorted.
+*/
+void find_time_range(const struct trace_index *idx, double start, double end,
+                     uint64_t *begin_off, uint64_t *end_off)
+{
+    size_t n = idx->entries.size();
+    std::vector<double> prefix_max(n), suffix_min(n);
+
+    for (size_t i = 0; i < n; i++)
+        prefix_max[i] = std::max(idx->entries[i].max_now, i > 0 ? prefix_max[i - 1] : idx->entries[i].max_now);
+    for (size_t i = n; i-- > 0; )
+        suffix_min[i] = std::min(idx->entries[i].min_now, i + 1 < n ? suffix_min[i + 1] : idx->entries[i].min_now);
+
+    // First block whose latest packet is not before start
+    size_t first = std::lower_bound(prefix_max.begin(), prefix_max.end(), start) - prefix_max.begin();
+    // One past the last block whose earliest packet is not after end
+    size_t last = std::upper_bound(suffix_min.begin(), suffix_min.end(), end) - suffix_min.begin();
+
+    if (first >= last)
+    {
+        *begin_off = *end_off = idx->indexed_bytes;
+        return;
+    }
+    *begin_off = idx->entries[first].offset;
+    *end_off = last < n ? idx->entries[last].offset : idx->indexed_bytes;
+}
@@ -0,0 +1,34 @@
+#ifndef TRACE_INDEX_H
+#define TRACE_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "reader.h"
+
+#define INDEX_STRIDE 4096           /* default number of packets per index entry */
+#define INDEX_SUFFIX ".idx"
+
+/* one block of stride consecutive packets: where it starts and the times it spans */
+struct index_entry
+{
+    uint64_t offset;
+    double min_now;
+    double max_now;
+};
+
+/* sparse timestamp index of a trace, kept in the sidecar file trace_file.idx */
+struct trace_index
+{
+    unsigned int stride;
+    unsigned int last_count;        /* packets in the last, possibly partial, block */
+    uint64_t indexed_bytes;         /* the trace is indexed up to this offset */
+    std::vector<struct index_entry> entries;
+};
+
+void update_index(const char *trace_filename, struct trace_reader *tr, unsigned int stride,
+                  struct trace_index *idx);
+void find_time_range(const struct trace_index *idx, double start, double end,
+                     uint64_t *begin_off, uint64_t *end_off);
+
+#endif
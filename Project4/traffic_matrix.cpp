@@ -0,0 +1,747 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: traffic_matrix.cpp
+ *
+ * Traffic matrix mode over interned hosts. Each address is looked up once per packet in a
+ * small host table that stays in cache, and the (src ID, dst ID) cell in a flat table
+ * whose slots are stored inline and probed linearly, so a cell update is a hash, a
+ * multiply and (usually) a single cache line.
+ * */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <queue>
+#include <algorithm>
+#include "traffic_matrix.h"
+#include "next.h"
+#include "stats.h"
+
+#define INITIAL_SLOTS 1024
+#define INITIAL_HOSTS 256
+#define MIN_SLOTS 16                /* smallest cell table a budget may shrink it to */
+#define MIN_RUN_BUF 256             /* fewest cells per run buffer before merging in passes */
+#define MAX_RUN_BUF 65536
+
+static const struct tm_entry EMPTY_SLOT = { TM_NO_HOST, TM_NO_HOST, 0 };
+static const struct tm_host4_slot EMPTY_HOST4 = { 0, TM_NO_HOST };
+
+
+/**
+ * Returns the home slot of a 64-bit key.
+*/
+static inline size_t hash_key(uint64_t key, size_t mask)
+{
+    return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+}
+
+
+/**
+ * Returns the home slot of an IPv6 address.
+*/
+static inline size_t hash_addr6(const void *addr, size_t mask)
+{
+    uint64_t words[2];
+
+    memcpy(words, addr, 16);
+    return hash_key(words[0] ^ (words[1] * 0xff51afd7ed558ccdull), mask);
+}
+
+
+TrafficMatrix::TrafficMatrix()
+    : hosts4(INITIAL_HOSTS, EMPTY_HOST4), hosts4_mask(INITIAL_HOSTS - 1),
+      hosts6_mask(0), num_hosts6(0),
+      slots(INITIAL_SLOTS, EMPTY_SLOT), mask(INITIAL_SLOTS - 1), count(0),
+      budget(0), spill_fd(-1), spilled(0)
+{
+}
+
+
+/**
+ * Gives the next host ID to a new address.
+*/
+uint32_t TrafficMatrix::new_host(const void *addr, size_t len, unsigned char version)
+{
+    struct tm_host host;
+
+    memset(&host, 0x0, sizeof(host));
+    memcpy(host.addr, addr, len);
+    host.version = version;
+    bool full = hosts.size() == hosts.capacity();
+    hosts.push_back(host);
+    if (full && budget > 0)
+        fit_budget();
+    return hosts.size() - 1;
+}
+
+
+/**
+ * Returns the host ID of an IPv4 address (network byte order), interning it if it is new.
+*/
+uint32_t TrafficMatrix::intern4(uint32_t addr)
+{
+    size_t i = hash_key(addr, hosts4_mask);
+
+    STATS_COUNT(hash_lookups, 1);
+    while (true)
+    {
+        struct tm_host4_slot &slot = hosts4[i];
+        STATS_COUNT(hash_probes, 1);
+        if (slot.id == TM_NO_HOST)
+            break;
+        if (slot.addr == addr)
+            return slot.id;
+        i = (i + 1) & hosts4_mask;
+    }
+
+    uint32_t id = new_host(&addr, sizeof(addr), 4);
+    hosts4[i].addr = addr;
+    hosts4[i].id = id;
+    if ((hosts.size() - num_hosts6) * 2 > hosts4.size())
+    {
+        grow_hosts4();
+        if (budget > 0)
+            fit_budget();
+    }
+    return id;
+}
+
+
+/**
+ * Returns the host ID of an IPv6 address (16 bytes), interning it if it is new. The table
+ * is only allocated once the first IPv6 address shows up.
+*/
+uint32_t TrafficMatrix::intern6(const void *addr)
+{
+    if (hosts6.empty())
+    {
+        struct tm_host6_slot empty;
+        memset(&empty, 0x0, sizeof(empty));
+        empty.id = TM_NO_HOST;
+        hosts6.assign(INITIAL_HOSTS, empty);
+        hosts6_mask = INITIAL_HOSTS - 1;
+    }
+
+    size_t i = hash_addr6(addr, hosts6_mask);
+    STATS_COUNT(hash_lookups, 1);
+    while (true)
+    {
+        struct tm_host6_slot &slot = hosts6[i];
+        STATS_COUNT(hash_probes, 1);
+        if (slot.id == TM_NO_HOST)
+            break;
+        if (memcmp(slot.addr, addr, 16) == 0)
+            return slot.id;
+        i = (i + 1) & hosts6_mask;
+    }
+
+    uint32_t id = new_host(addr, 16, 6);
+    memcpy(hosts6[i].addr, addr, 16);
+    hosts6[i].id = id;
+    if (++num_hosts6 * 2 > hosts6.size())
+    {
+        grow_hosts6();
+        if (budget > 0)
+            fit_budget();
+    }
+    return id;
+}
+
+
+/**
+ * Doubles the IPv4 host table and reinserts every address.
+*/
+void TrafficMatrix::grow_hosts4()
+{
+    std::vector<struct tm_host4_slot> old(hosts4.size() * 2, EMPTY_HOST4);
+    old.swap(hosts4);
+    hosts4_mask = hosts4.size() - 1;
+    STATS_COUNT(hash_resizes, 1);
+
+    for (const auto &slot: old)
+    {
+        if (slot.id == TM_NO_HOST)
+            continue;
+        size_t i = hash_key(slot.addr, hosts4_mask);
+        while (hosts4[i].id != TM_NO_HOST)
+            i = (i + 1) & hosts4_mask;
+        hosts4[i] = slot;
+    }
+}
+
+
+/**
+ * Doubles the IPv6 host table and reinserts every address.
+*/
+void TrafficMatrix::grow_hosts6()
+{
+    struct tm_host6_slot empty;
+    memset(&empty, 0x0, sizeof(empty));
+    empty.id = TM_NO_HOST;
+
+    std::vector<struct tm_host6_slot> old(hosts6.size() * 2, empty);
+    old.swap(hosts6);
+    hosts6_mask = hosts6.size() - 1;
+    STATS_COUNT(hash_resizes, 1);
+
+    for (const auto &slot: old)
+    {
+        if (slot.id == TM_NO_HOST)
+            continue;
+        size_t i = hash_addr6(slot.addr, hosts6_mask);
+        while (hosts6[i].id != TM_NO_HOST)
+            i = (i + 1) & hosts6_mask;
+        hosts6[i] = slot;
+    }
+}
+
+
+/**
+ * Adds bytes to the cell of two host IDs, inserting the cell if it is new.
+*/
+void TrafficMatrix::add_ids(uint32_t src, uint32_t dst, long long bytes)
+{
+    size_t i = hash_key(((uint64_t) src << 32) | dst, mask);
+
+    STATS_COUNT(hash_lookups, 1);
+    while (true)
+    {
+        struct tm_entry &slot = slots[i];
+        STATS_COUNT(hash_probes, 1);
+        if (slot.src == src && slot.dst == dst)
+        {
+            slot.bytes += bytes;
+            return;
+        }
+        if (slot.src == TM_NO_HOST)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    slots[i].src = src;
+    slots[i].dst = dst;
+    slots[i].bytes = bytes;
+    count++;
+
+    // Keep the load factor under 1/2 so probe sequences stay short; growing holds the old
+    // and the doubled table at once
+    if (count * 2 > slots.size())
+    {
+        if (budget > 0 && slots.size() * 3 * sizeof(struct tm_entry) + host_bytes() > budget)
+            spill();
+        else
+            grow();
+    }
+}
+
+
+/**
+ * Adds bytes to the total of the IPv4 src/dst pair (network byte order).
+*/
+void TrafficMatrix::add(uint32_t src, uint32_t dst, long long bytes)
+{
+    add_ids(intern4(src), intern4(dst), bytes);
+}
+
+
+/**
+ * Adds bytes to the total of an IPv6 src/dst pair (16 byte addresses).
+*/
+void TrafficMatrix::add6(const void *src, const void *dst, long long bytes)
+{
+    add_ids(intern6(src), intern6(dst), bytes);
+}
+
+
+/**
+ * Doubles the cell table and reinserts every cell.
+*/
+void TrafficMatrix::grow()
+{
+    std::vector<struct tm_entry> old(slots.size() * 2, EMPTY_SLOT);
+    old.swap(slots);
+    mask = slots.size() - 1;
+    STATS_COUNT(hash_resizes, 1);
+
+    for (const auto &entry: old)
+    {
+        if (entry.src == TM_NO_HOST)
+            continue;
+        size_t i = hash_key(((uint64_t) entry.src << 32) | entry.dst, mask);
+        while (slots[i].src != TM_NO_HOST)
+            i = (i + 1) & mask;
+        slots[i] = entry;
+    }
+}
+
+
+/**
+ * Adds every cell of another traffic matrix into this one, interning its hosts here.
+*/
+void TrafficMatrix::merge(const TrafficMatrix &other)
+{
+    std::vector<uint32_t> id(other.hosts.size());
+
+    for (size_t i = 0; i < other.hosts.size(); i++)
+    {
+        const struct tm_host &host = other.hosts[i];
+        if (host.version == 4)
+        {
+            uint32_t addr;
+            memcpy(&addr, host.addr, sizeof(addr));
+            id[i] = intern4(addr);
+        }
+        else
+            id[i] = intern6(host.addr);
+    }
+
+    for (const auto &entry: other.slots)
+    {
+        if (entry.src != TM_NO_HOST)
+            add_ids(id[entry.src], id[entry.dst], entry.bytes);
+    }
+}
+
+
+/**
+ * Removes every host and cell and releases the tables.
+*/
+void TrafficMatrix::clear()
+{
+    *this = TrafficMatrix();
+}
+
+
+/**
+ * Appends the hosts and cells to a snapshot section: the number of hosts, each as its
+ * version and its 4 or 16 address bytes in ID order, then the number of cells and the
+ * cells themselves.
+*/
+void TrafficMatrix::save(std::vector<unsigned char> &out) const
+{
+    uint64_t n = hosts.size();
+
+    ckpt_put(out, &n, sizeof(n));
+    for (const auto &host: hosts)
+    {
+        ckpt_put(out, &host.version, sizeof(host.version));
+        ckpt_put(out, host.addr, host.version == 4 ? 4 : 16);
+    }
+
+    n = count;
+    ckpt_put(out, &n, sizeof(n));
+    for (const auto &entry: slots)
+    {
+        if (entry.src != TM_NO_HOST)
+            ckpt_put(out, &entry, sizeof(entry));
+    }
+}
+
+
+/**
+ * Adds every cell of a matrix saved by save() into this one, like merge().
+ * Returns false if the section is malformed.
+*/
+bool TrafficMatrix::load(struct ckpt_reader *in)
+{
+    uint64_t n;
+    std::vector<uint32_t> id;
+
+    if (!ckpt_get(in, &n, sizeof(n)) || n > (size_t) (in->end - in->p))
+        return false;
+    id.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char version;
+        unsigned char addr[16];
+        if (!ckpt_get(in, &version, sizeof(version)))
+            return false;
+        if (version == 4)
+        {
+            uint32_t addr4;
+            if (!ckpt_get(in, &addr4, sizeof(addr4)))
+                return false;
+            id[i] = intern4(addr4);
+        }
+        else if (version == 6 && ckpt_get(in, addr, sizeof(addr)))
+            id[i] = intern6(addr);
+        else
+            return false;
+    }
+
+    if (!ckpt_get(in, &n, sizeof(n)))
+        return false;
+    for (size_t i = 0; i < n; i++)
+    {
+        struct tm_entry entry;
+        if (!ckpt_get(in, &entry, sizeof(entry)) || entry.src >= id.size() || entry.dst >= id.size())
+            return false;
+        add_ids(id[entry.src], id[entry.dst], entry.bytes);
+    }
+    return true;
+}
+
+
+/**
+ * Appends every cell to out ordered by the rank of its src host, then of its dst host,
+ * where rank[id] < num_hosts() is the position of host id in the wanted order. This is an
+ * LSD radix sort with host ranks as its two digits, each pass a counting sort, so it takes
+ * linear time. row_start, if given, receives the CSR row starts: the cells of the host
+ * ranked r are out[row_start[r] .. row_start[r + 1]) (relative to where out started).
+*/
+void TrafficMatrix::sorted_entries(const std::vector<uint32_t> &rank, std::vector<struct tm_entry> &out,
+                                   std::vector<size_t> *row_start) const
+{
+    size_t n = hosts.size();
+    std::vector<struct tm_entry> by_dst(count);
+    std::vector<size_t> start(n + 1, 0);
+
+    // Pass 1: by dst rank
+    for (const auto &entry: slots)
+    {
+        if (entry.src != TM_NO_HOST)
+            start[rank[entry.dst] + 1]++;
+    }
+    for (size_t r = 0; r < n; r++)
+        start[r + 1] += start[r];
+    for (const auto &entry: slots)
+    {
+        if (entry.src != TM_NO_HOST)
+            by_dst[start[rank[entry.dst]]++] = entry;
+    }
+
+    // Pass 2: stably by src rank, leaving the CSR row starts behind
+    std::fill(start.begin(), start.end(), 0);
+    for (const auto &entry: by_dst)
+        start[rank[entry.src] + 1]++;
+    for (size_t r = 0; r < n; r++)
+        start[r + 1] += start[r];
+    if (row_start != NULL)
+        *row_start = start;
+
+    size_t base = out.size();
+    out.resize(base + count);
+    for (const auto &entry: by_dst)
+        out[base + start[rank[entry.src]]++] = entry;
+}
+
+
+/**
+ * Tells whether host x comes before host y in numeric order: IPv4 addresses before IPv6
+ * ones, each by address value.
+*/
+static bool host_less(const struct tm_host &x, const struct tm_host &y)
+{
+    if (x.version != y.version)
+        return x.version < y.version;
+    return memcmp(x.addr, y.addr, sizeof(x.addr)) < 0;
+}
+
+
+/**
+ * Sets rank[id] to the position of host id in numeric order. The order of two hosts never
+ * changes as hosts are added.
+*/
+void TrafficMatrix::host_ranks(std::vector<uint32_t> &rank) const
+{
+    std::vector<uint32_t> order(hosts.size());
+
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+    {
+        return host_less(hosts[a], hosts[b]);
+    });
+    rank.resize(order.size());
+    for (size_t r = 0; r < order.size(); r++)
+        rank[order[r]] = r;
+}
+
+
+/**
+ * Caps the memory of the hosts and cells at bytes: once the cell table would grow past
+ * what the hosts leave of that, its cells are spilled to an unlinked file in spill_dir
+ * instead. Hosts cannot be spilled, so a budget they outgrow is an error.
+*/
+void TrafficMatrix::set_budget(size_t bytes, const char *dir)
+{
+    budget = bytes;
+    spill_dir = dir;
+    fit_budget();
+}
+
+
+/**
+ * Returns the bytes held for the hosts: the address list, the interning tables, and the
+ * two rank arrays that spilling and merging build.
+*/
+size_t TrafficMatrix::host_bytes() const
+{
+    return hosts.capacity() * (sizeof(struct tm_host) + 2 * sizeof(uint32_t))
+           + hosts4.capacity() * sizeof(struct tm_host4_slot)
+           + hosts6.capacity() * sizeof(struct tm_host6_slot);
+}
+
+
+/**
+ * Makes the hosts and the cell table fit the budget again after the hosts grew, by
+ * spilling the cells and shrinking the table. Exits if the hosts alone outgrow it.
+*/
+void TrafficMatrix::fit_budget()
+{
+    size_t n = slots.size();
+
+    if (n * sizeof(struct tm_entry) + host_bytes() <= budget)
+        return;
+    spill();
+    while (n > MIN_SLOTS && n * sizeof(struct tm_entry) + host_bytes() > budget)
+        n /= 2;
+    if (n * sizeof(struct tm_entry) + host_bytes() > budget)
+        errexit("Memory budget (-M) too small for the %s hosts of the traffic matrix",
+                std::to_string(hosts.size()).c_str());
+    std::vector<struct tm_entry>(n, EMPTY_SLOT).swap(slots);
+    mask = n - 1;
+}
+
+
+/**
+ * Appends n cells to the spill file.
+*/
+void TrafficMatrix::write_cells(const struct tm_entry *cells, size_t n)
+{
+    const char *data = (const char *) cells;
+    size_t left = n * sizeof(struct tm_entry);
+
+    while (left > 0)
+    {
+        ssize_t written = write(spill_fd, data, left);
+        STATS_SYSCALL(SYSCALL_WRITE);
+        if (written <= 0)
+            errexit("cannot write spill file in %s", spill_dir.c_str());
+        data += written;
+        left -= written;
+    }
+    spilled += n;
+}
+
+
+/**
+ * Appends every cell in memory to the spill file as one run in numeric (src, dst) order
+ * and empties the table. The cells are moved to the front of the table and sorted there,
+ * so spilling needs no memory beyond the table itself and ranks of its hosts. Only the
+ * hosts of the spilled cells are ranked, not the whole (ever growing) host table.
+*/
+void TrafficMatrix::spill()
+{
+    if (count == 0)
+        return;
+    if (spill_fd < 0)
+    {
+        std::string path = spill_dir + "/proj4-spill.XXXXXX";
+        if ((spill_fd = mkstemp(&path[0])) < 0)
+            errexit("cannot create spill file in %s", spill_dir.c_str());
+        unlink(path.c_str());
+        STATS_SYSCALL(SYSCALL_OTHER);
+        STATS_SYSCALL(SYSCALL_OTHER);
+    }
+
+    std::vector<uint32_t> rank(hosts.size(), TM_NO_HOST);
+    std::vector<uint32_t> present;
+    size_t n = 0;
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        if (slots[i].src == TM_NO_HOST)
+            continue;
+        slots[n++] = slots[i];
+        for (uint32_t id: { slots[i].src, slots[i].dst })
+        {
+            if (rank[id] == TM_NO_HOST)
+            {
+                rank[id] = 0;
+                present.push_back(id);
+            }
+        }
+    }
+    std::sort(present.begin(), present.end(), [&](uint32_t a, uint32_t b)
+    {
+        return host_less(hosts[a], hosts[b]);
+    });
+    for (size_t r = 0; r < present.size(); r++)
+        rank[present[r]] = r;
+
+    std::sort(slots.begin(), slots.begin() + n, [&](const struct tm_entry &a, const struct tm_entry &b)
+    {
+        return rank[a.src] < rank[b.src] || (rank[a.src] == rank[b.src] && rank[a.dst] < rank[b.dst]);
+    });
+
+    struct tm_run run = { spilled, n };
+    runs.push_back(run);
+    write_cells(slots.data(), n);
+    std::fill(slots.begin(), slots.end(), EMPTY_SLOT);
+    count = 0;
+}
+
+
+/* read position in one spilled run while the runs are merged */
+struct run_cursor
+{
+    uint64_t next;              /* next cell of the run not in buf */
+    uint64_t end;
+    std::vector<struct tm_entry> buf;
+    size_t pos;
+};
+
+
+/**
+ * Refills the buffer of a run cursor. Returns false once the run is exhausted.
+*/
+static bool refill(int fd, struct run_cursor *cur, size_t cap)
+{
+    size_t n = std::min((uint64_t) cap, cur->end - cur->next);
+    if (n == 0)
+        return false;
+
+    cur->buf.resize(n);
+    size_t len = n * sizeof(struct tm_entry);
+    ssize_t got = pread(fd, cur->buf.data(), len, cur->next * sizeof(struct tm_entry));
+    STATS_SYSCALL(SYSCALL_READ);
+    if (got != (ssize_t) len)
+        errexit("cannot read back spill file", NULL);
+    cur->next += n;
+    cur->pos = 0;
+    return true;
+}
+
+
+/**
+ * Calls emit on every cell of the spilled runs [first, last) in numeric (src, dst) order,
+ * adding up the cells of a pair that was spilled more than once: a k-way merge over a heap
+ * of the runs, reading each through a buffer of cap cells.
+*/
+void TrafficMatrix::merge_runs(const std::vector<uint32_t> &rank, size_t first, size_t last, size_t cap,
+                               const std::function<void(const struct tm_entry &)> &emit) const
+{
+    typedef std::pair<uint64_t, size_t> head;   /* (src rank, dst rank) key, run */
+    std::priority_queue<head, std::vector<head>, std::greater<head> > heap;
+    std::vector<struct run_cursor> cursors(last - first);
+
+    auto key = [&](const struct tm_entry &e) { return ((uint64_t) rank[e.src] << 32) | rank[e.dst]; };
+
+    for (size_t r = 0; r < cursors.size(); r++)
+    {
+        cursors[r].next = runs[first + r].offset;
+        cursors[r].end = runs[first + r].offset + runs[first + r].count;
+        if (refill(spill_fd, &cursors[r], cap))
+            heap.push(head(key(cursors[r].buf[0]), r));
+    }
+
+    struct tm_entry pending = EMPTY_SLOT;
+    uint64_t pending_key = 0;
+    while (!heap.empty())
+    {
+        head top = heap.top();
+        heap.pop();
+        struct run_cursor &cur = cursors[top.second];
+        const struct tm_entry &entry = cur.buf[cur.pos];
+
+        if (pending.src != TM_NO_HOST && top.first == pending_key)
+            pending.bytes += entry.bytes;
+        else
+        {
+            if (pending.src != TM_NO_HOST)
+                emit(pending);
+            pending = entry;
+            pending_key = top.first;
+        }
+
+        if (++cur.pos < cur.buf.size() || refill(spill_fd, &cur, cap))
+            heap.push(head(key(cur.buf[cur.pos]), top.second));
+    }
+    if (pending.src != TM_NO_HOST)
+        emit(pending);
+}
+
+
+/**
+ * Merges every fan_in consecutive runs into one longer run at the end of the spill file,
+ * through an output buffer of cap cells, and gives the file space of the merged runs back.
+*/
+void TrafficMatrix::merge_pass(const std::vector<uint32_t> &rank, size_t fan_in, size_t cap)
+{
+    std::vector<struct tm_run> merged;
+    std::vector<struct tm_entry> out;
+
+    out.reserve(cap);
+    for (size_t first = 0; first < runs.size(); first += fan_in)
+    {
+        size_t last = std::min(first + fan_in, runs.size());
+        if (last - first == 1)
+        {
+            merged.push_back(runs[first]);
+            continue;
+        }
+
+        struct tm_run run = { spilled, 0 };
+        merge_runs(rank, first, last, cap, [&](const struct tm_entry &cell)
+        {
+            out.push_back(cell);
+            if (out.size() == cap)
+            {
+                write_cells(out.data(), out.size());
+                out.clear();
+            }
+        });
+        write_cells(out.data(), out.size());
+        out.clear();
+        run.count = spilled - run.offset;
+        merged.push_back(run);
+
+        // The merged runs lie next to each other in the file
+        uint64_t begin = runs[first].offset * sizeof(struct tm_entry);
+        uint64_t end = (runs[last - 1].offset + runs[last - 1].count) * sizeof(struct tm_entry);
+        fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, end - begin);
+        STATS_SYSCALL(SYSCALL_OTHER);
+    }
+    runs.swap(merged);
+}
+
+
+/**
+ * Calls emit on every cell in numeric (src, dst) order. A budgeted matrix spills what is
+ * left in memory, frees the table and merges the runs, so it is empty afterwards. The run
+ * buffers get what the hosts leave of the budget; while that gives fewer than MIN_RUN_BUF
+ * cells to each run, the runs are first merged into fewer, longer ones.
+*/
+void TrafficMatrix::for_each_sorted(const std::function<void(const struct tm_entry &)> &emit)
+{
+    std::vector<uint32_t> rank;
+    host_ranks(rank);
+
+    if (budget == 0)
+    {
+        std::vector<struct tm_entry> cells;
+        sorted_entries(rank, cells);
+        for (const auto &cell: cells)
+            emit(cell);
+        return;
+    }
+
+    spill();
+    std::vector<struct tm_entry>().swap(slots);
+
+    size_t cells = budget > host_bytes() ? (budget - host_bytes()) / sizeof(struct tm_entry) : 0;
+    size_t fan_in = cells / MIN_RUN_BUF > 3 ? cells / MIN_RUN_BUF - 1 : 2;   /* one buffer for output */
+    size_t cap = std::max((size_t) 1, std::min((size_t) MAX_RUN_BUF, cells / (fan_in + 1)));
+    while (runs.size() > fan_in)
+        merge_pass(rank, fan_in, cap);
+    merge_runs(rank, 0, runs.size(), cap, emit);
+
+    close(spill_fd);
+    spill_fd = -1;
+    runs.clear();
+    spilled = 0;
+    *this = TrafficMatrix();
+}
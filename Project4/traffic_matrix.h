@@ -0,0 +1,127 @@
+#ifndef TRAFFIC_MATRIX_H
+#define TRAFFIC_MATRIX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include "checkpoint.h"
+
+/* one address of the traffic matrix, in network byte order; IPv4 uses the first 4 bytes */
+struct tm_host
+{
+    unsigned char addr[16];
+    unsigned char version;      /* 4 or 6 */
+};
+
+/* one nonzero cell of the traffic matrix: payload bytes between two interned hosts */
+struct tm_entry
+{
+    uint32_t src;               /* host IDs */
+    uint32_t dst;
+    long long bytes;
+};
+
+/* slots of the host interning tables; id is TM_NO_HOST in an unused slot */
+struct tm_host4_slot
+{
+    uint32_t addr;
+    uint32_t id;
+};
+
+struct tm_host6_slot
+{
+    unsigned char addr[16];
+    uint32_t id;
+};
+
+#define TM_NO_HOST 0xffffffffu
+
+/* a run of cells spilled to disk in numeric (src, dst) address order */
+struct tm_run
+{
+    uint64_t offset;            /* in cells, into the spill file */
+    uint64_t count;
+};
+
+#define TM_DENSE_MAGIC "P4DENSE1"
+#define TM_DENSE_MAX_HOSTS 8192     /* 512 MiB of cells */
+
+/*
+ * Start of a dense matrix file (-D), in host byte order; it is followed by num_hosts
+ * 16 byte addresses and num_hosts * num_hosts int64 cells, row (src) major.
+ */
+struct tm_dense_header
+{
+    char magic[8];
+    uint32_t num_hosts;
+    uint32_t reserved;
+};
+
+/**
+ * Payload bytes per (src, dst) address pair. Addresses (IPv4 and IPv6 alike) are interned
+ * into dense host IDs as they are first seen, and the matrix is a sparse COO set of
+ * (src ID, dst ID, bytes) cells kept in an open-addressing table keyed on the ID pair.
+ * sorted_entries() orders the cells by any ranking of the hosts with a two pass radix
+ * sort, which also yields the CSR row starts. Text conversion is left to whoever prints it.
+ * With a memory budget, the cells are spilled to disk as sorted runs whenever the table
+ * and the hosts would outgrow it, and for_each_sorted() merges the runs back exactly, in
+ * as many passes as the budget needs.
+*/
+class TrafficMatrix
+{
+public:
+    TrafficMatrix();
+
+    void add(uint32_t src, uint32_t dst, long long bytes);
+    void add6(const void *src, const void *dst, long long bytes);
+    void merge(const TrafficMatrix &other);
+    void clear();
+    void save(std::vector<unsigned char> &out) const;
+    bool load(struct ckpt_reader *in);
+    size_t size() const { return count; }
+    size_t num_hosts() const { return hosts.size(); }
+    const struct tm_host &host(uint32_t id) const { return hosts[id]; }
+    void sorted_entries(const std::vector<uint32_t> &rank, std::vector<struct tm_entry> &out,
+                        std::vector<size_t> *row_start = NULL) const;
+    void host_ranks(std::vector<uint32_t> &rank) const;
+    void set_budget(size_t bytes, const char *spill_dir);
+    size_t num_runs() const { return runs.size(); }
+    void for_each_sorted(const std::function<void(const struct tm_entry &)> &emit);
+
+private:
+    uint32_t intern4(uint32_t addr);
+    uint32_t intern6(const void *addr);
+    uint32_t new_host(const void *addr, size_t len, unsigned char version);
+    void add_ids(uint32_t src, uint32_t dst, long long bytes);
+    void grow();
+    void grow_hosts4();
+    void grow_hosts6();
+    void spill();
+    size_t host_bytes() const;
+    void fit_budget();
+    void write_cells(const struct tm_entry *cells, size_t n);
+    void merge_runs(const std::vector<uint32_t> &rank, size_t first, size_t last, size_t cap,
+                    const std::function<void(const struct tm_entry &)> &emit) const;
+    void merge_pass(const std::vector<uint32_t> &rank, size_t fan_in, size_t cap);
+
+    std::vector<struct tm_host> hosts;      /* by host ID */
+    std::vector<struct tm_host4_slot> hosts4;
+    size_t hosts4_mask;
+    std::vector<struct tm_host6_slot> hosts6;   /* allocated with the first IPv6 host */
+    size_t hosts6_mask;
+    size_t num_hosts6;
+
+    std::vector<struct tm_entry> slots;     /* src == TM_NO_HOST marks an unused slot */
+    size_t mask;
+    size_t count;
+
+    size_t budget;                          /* bytes of hosts and cells in memory, 0 if unlimited */
+    std::string spill_dir;
+    int spill_fd;                           /* unlinked file of the spilled runs, -1 if none */
+    std::vector<struct tm_run> runs;
+    uint64_t spilled;                       /* cells in the spill file */
+};
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * CSDS 325 Project 4 (2022 Fall Semester)
+ *
+ * Filename: window.cpp
+ *
+ * Sliding-window traffic matrix for -w: a ring of per-slice sub-matrices that the window
+ * moves along one slice at a time.
+ * */
+
+
+#include <math.h>
+#include "next.h"
+#include "window.h"
+
+
+/**
+ * Sets up an empty window of window seconds that moves on every seconds. The window must
+ * be a whole number of slices.
+*/
+void SlidingWindow::init(double window, double slice_width)
+{
+    size_t num_slices = (size_t) llround(window / slice_width);
+
+    if (num_slices < 1 || num_slices > WINDOW_MAX_SLICES)
+        errexit("Too many window slices, use a larger snapshot interval", NULL);
+    every = slice_width;
+    slices.assign(num_slices, TrafficMatrix());
+    head = 0;
+    idle = 0;
+    started = false;
+}
+
+
+/**
+ * Returns the sub-matrix of the slice a packet at time now goes into. The first packet
+ * places the window; packets from before the head slice still go into it.
+*/
+TrafficMatrix &SlidingWindow::current(double now)
+{
+    if (!started)
+    {
+        slice_end = (floor(now / every) + 1) * every;
+        started = true;
+    }
+    idle = 0;
+    return slices[head];
+}
+
+
+/**
+ * Moves the window on by one slice, dropping the oldest one. Once every slice has been
+ * dropped since the last packet the window is empty, and if the packet at time now is
+ * still past it, the window skips straight to that packet's slice.
+*/
+void SlidingWindow::advance(double now)
+{
+    head = (head + 1) % slices.size();
+    slices[head].clear();
+    slice_end += every;
+
+    if (++idle >= slices.size() && now >= slice_end)
+        slice_end = (floor(now / every) + 1) * every;
+}
+
+
+/**
+ * Adds up the slices into out, the traffic matrix of the whole window.
+*/
+void SlidingWindow::snapshot(TrafficMatrix &out) const
+{
+    for (const auto &slice: slices)
+        out.merge(slice);
+}
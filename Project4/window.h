@@ -0,0 +1,39 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include <stddef.h>
+#include <vector>
+#include "traffic_matrix.h"
+
+#define WINDOW_MAX_SLICES 4096      /* refuse windows that would need more slices than this */
+
+/**
+ * Traffic matrix over a sliding window of the last num_slices * every seconds, kept as a
+ * ring of one sub-matrix per time slice. Slice i covers [i * every, (i + 1) * every).
+ * Moving the window on drops the oldest slice whole, so eviction costs the size of that
+ * slice, not of the window; the slices are only added up when a snapshot is taken.
+*/
+class SlidingWindow
+{
+public:
+    SlidingWindow() : every(0), head(0), idle(0), started(false), slice_end(0) {}
+
+    void init(double window, double every);
+    bool enabled() const { return every > 0; }
+    bool due(double now) const { return started && now >= slice_end; }
+    TrafficMatrix &current(double now);
+    void advance(double now);
+    void snapshot(TrafficMatrix &out) const;
+    double end() const { return slice_end; }
+    double start() const { return slice_end - slices.size() * every; }
+
+private:
+    double every;                   /* slice width in seconds */
+    std::vector<TrafficMatrix> slices;
+    size_t head;                    /* slice of the latest packets; the oldest follows it */
+    size_t idle;                    /* slices moved on since the last packet */
+    bool started;
+    double slice_end;               /* end of the head slice */
+};
+
+#endif